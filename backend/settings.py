@@ -157,6 +157,13 @@ USE_TZ = True
 
 STATIC_URL = "static/"
 
+# Sessions the game server answers /api/get_user_info/ from, must match its
+# ZINGERS_SESSIONS_FILE. Created with mode 0600, keep it out of any directory
+# that's served or shared.
+ZINGERS_SESSIONS_FILE = Path(
+    os.environ.get("ZINGERS_SESSIONS_FILE", BASE_DIR / "sessions.tsv")
+)
+
 # Default primary key field type
 # https://docs.djangoproject.com/en/5.0/ref/settings/#default-auto-field
 
@@ -20,12 +20,12 @@ from django.urls import path, include
 from django.views.generic.base import TemplateView
 from django.contrib.auth.decorators import login_required
 
-from backend.views import get_user_info
+from backend.views import get_user_info, index
 
 urlpatterns = [
     path("admin/", admin.site.urls),
     path("accounts/", include("allauth.urls")),
-    path("", TemplateView.as_view(template_name="index.html"), name="index"),
+    path("", index, name="index"),
     path(
         "game/",
         login_required(TemplateView.as_view(template_name="game.html")),
@@ -1,6 +1,68 @@
+import fcntl
+import os
+
+from django.conf import settings
 from django.contrib.auth.decorators import login_required
-from django.http import HttpRequest
+from django.contrib.auth.signals import user_logged_in, user_logged_out
+from django.dispatch import receiver
+from django.http import HttpRequest, HttpResponse
 from django.http.response import JsonResponse
+from django.shortcuts import render
+
+
+def display_name(user) -> str:
+    return user.get_full_name() or user.username
+
+
+def append_session_line(line: str) -> None:
+    # One short O_APPEND write per line, so lines from different workers
+    # never interleave. Live session keys are credentials, so the file is only
+    # ever readable by the user running the web app and the game server.
+    # The game server compacts the file by renaming a copy over it while
+    # holding an exclusive flock, so a line written to the old file would be
+    # lost. Write under a shared one, to whichever file is current.
+    path = settings.ZINGERS_SESSIONS_FILE
+    while True:
+        fd = os.open(path, os.O_WRONLY | os.O_APPEND | os.O_CREAT, 0o600)
+        try:
+            fcntl.flock(fd, fcntl.LOCK_SH)
+            if os.fstat(fd).st_ino != os.stat(path).st_ino:
+                continue
+            os.fchmod(fd, 0o600)
+            os.write(fd, (line + "\n").encode("utf-8"))
+            return
+        finally:
+            os.close(fd)
+
+
+def export_session(request: HttpRequest) -> None:
+    """Tells the game server who this session belongs to, once."""
+    key = request.session.session_key
+    if key is None or request.session.get("zingers_exported_key") == key:
+        return
+    name = " ".join(display_name(request.user).split())
+    # Setting the flag saves the session, so its cookie gets this expiry too
+    expires = int(request.session.get_expiry_date().timestamp())
+    append_session_line(f"{key}\t{request.user.id}\t{expires}\t{name}")
+    request.session["zingers_exported_key"] = key
+
+
+@receiver(user_logged_in)
+def on_login(sender, request: HttpRequest, user, **kwargs) -> None:
+    export_session(request)
+
+
+@receiver(user_logged_out)
+def on_logout(sender, request: HttpRequest, user, **kwargs) -> None:
+    if request.session.session_key is not None:
+        append_session_line(request.session.session_key)
+
+
+def index(request: HttpRequest) -> HttpResponse:
+    # Covers sessions that logged in before the game server took over
+    if request.user.is_authenticated:
+        export_session(request)
+    return render(request, "index.html")
 
 
 @login_required
@@ -8,7 +70,7 @@ def get_user_info(request: HttpRequest) -> JsonResponse:
     return JsonResponse(
         {
             "user_id": request.user.id,
-            "username": request.user.get_full_name() or request.user.username,
+            "username": display_name(request.user),
         },
         status=200,
     )
@@ -81,8 +81,12 @@ const App = () => {
       .catch((error) => console.error(error));
   }, [userInfo, registered]);
 
+  // Re-registering after a reconnect must not refetch the whole game state,
+  // the asset socket resumes from its last sequence number instead
   const handle_register_message = (asset: Asset) => {
-    setRegistered((registered) => ({ ...registered, [asset]: true }));
+    setRegistered((registered) =>
+      registered[asset] ? registered : { ...registered, [asset]: true },
+    );
   };
 
   return (
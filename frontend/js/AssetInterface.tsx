@@ -1,6 +1,12 @@
 import React, { createContext, useContext, useEffect, useRef } from "react";
 import Asset from "./Asset";
-import { IncomingMessage, MessageType, OutgoingMessage } from "./Message.ts";
+import {
+  IncomingMessage,
+  MessageType,
+  OutgoingMessage,
+  decode,
+  supportsDeflate,
+} from "./Message.ts";
 import { ConnectionContext, GameStateContext } from "./App";
 import Side from "./Side.ts";
 import Trade from "./Trade.ts";
@@ -21,7 +27,7 @@ const AssetInterface = ({
   userInfo: UserInfo | undefined;
   handle_register_message: (asset: Asset) => void;
 }) => {
-  const { setGameState } = useContext(GameStateContext);
+  const { gameState, setGameState } = useContext(GameStateContext);
   const { setConnections } = useContext(ConnectionContext);
 
   const settle_trades = (prevGameState: GameState, trades: Trade[]) => {
@@ -152,7 +158,96 @@ const AssetInterface = ({
     });
   };
 
+  const handle_snapshot_message = (incoming: IncomingMessage) => {
+    if (!setGameState) {
+      console.error("setGameState:", setGameState);
+      return;
+    }
+
+    setGameState((prevGameState) => {
+      if (!prevGameState) {
+        console.error("Previous gameState is undefined");
+        return prevGameState;
+      }
+
+      const updatedGameState = JSON.parse(
+        JSON.stringify(prevGameState),
+      ) as GameState;
+
+      for (const order of Object.values(prevGameState.orders)) {
+        if (order.asset === asset) {
+          delete updatedGameState.orders[order.order_id];
+        }
+      }
+      for (const order of incoming.orders ?? []) {
+        updatedGameState.orders[order.order_id] = order;
+      }
+
+      return updatedGameState;
+    });
+  };
+
+  // The server's word on our balances, replacing whatever settle_trades
+  // worked out from the public feed
+  const handle_position_message = (incoming: IncomingMessage) => {
+    const position = incoming.position;
+    if (!setGameState || !position) {
+      return;
+    }
+    setGameState((prevGameState) => {
+      if (!prevGameState || position.version < prevGameState.version) {
+        return prevGameState;
+      }
+      const assets_held = [...prevGameState.assets_held];
+      const selling_power = [...prevGameState.selling_power];
+      assets_held[position.asset as number] = position.assets_held;
+      selling_power[position.asset as number] = position.selling_power;
+      return {
+        ...prevGameState,
+        version: position.version,
+        cash: position.cash,
+        buying_power: position.buying_power,
+        assets_held,
+        selling_power,
+      };
+    });
+  };
+
   const ws = useRef<WebSocket | undefined>(undefined);
+  // Last sequence number applied, survives reconnects so we can resume
+  const lastSeq = useRef<number | undefined>(undefined);
+  const resumePending = useRef(false);
+
+  const request_resume = (socket: WebSocket) => {
+    if (lastSeq.current === undefined || resumePending.current) {
+      return;
+    }
+    resumePending.current = true;
+    const outgoing = {
+      type: MessageType.RESUME,
+      seq: lastSeq.current,
+    } as OutgoingMessage;
+    socket.send(JSON.stringify(outgoing));
+  };
+
+  // Drops duplicates and asks for a replay when a published message skips
+  // ahead, returns whether the message should be applied
+  const in_sequence = (socket: WebSocket, incoming: IncomingMessage) => {
+    if (incoming.seq === undefined || lastSeq.current === undefined) {
+      lastSeq.current = incoming.seq ?? lastSeq.current;
+      return true;
+    }
+    if (incoming.seq <= lastSeq.current) {
+      return false;
+    }
+    if (incoming.seq > lastSeq.current + 1) {
+      request_resume(socket);
+      return false;
+    }
+    lastSeq.current = incoming.seq;
+    resumePending.current = false;
+    return true;
+  };
 
   useEffect(() => {
     if (userInfo === undefined || setConnections === undefined) {
@@ -160,8 +255,15 @@ const AssetInterface = ({
     }
 
     const connect = () => {
-      const wsUrl = `wss://${window.location.host}/asset/${Asset.toString(asset)}`;
+      // Long market data frames arrive compressed where the browser can
+      // inflate them
+      const path = supportsDeflate ? "/deflate" : "";
+      const wsUrl = `wss://${window.location.host}/asset/${Asset.toString(asset)}${path}`;
       const socket = new WebSocket(wsUrl);
+      socket.binaryType = "arraybuffer";
+      // Inflating is asynchronous, chained so messages are still handled in
+      // the order they arrived
+      let received = Promise.resolve();
 
       socket.onopen = () => {
         const outgoing = {
@@ -176,17 +278,36 @@ const AssetInterface = ({
         connect();
       };
       socket.onmessage = (event: MessageEvent) => {
-        const incoming = JSON.parse(event.data) as IncomingMessage;
+        received = received.then(async () =>
+          handle_message(await decode(event.data)),
+        );
+      };
+      const handle_message = (data: string) => {
+        const incoming = JSON.parse(data) as IncomingMessage;
         console.log(incoming);
         switch (incoming.type as MessageType) {
           case MessageType.REGISTER:
             handle_register_message(asset);
+            resumePending.current = false;
+            request_resume(socket);
             break;
           case MessageType.ORDER:
-            handle_order_message(incoming);
+            if (in_sequence(socket, incoming)) {
+              handle_order_message(incoming);
+            }
             break;
           case MessageType.CANCEL:
-            handle_cancel_message(incoming);
+            if (in_sequence(socket, incoming)) {
+              handle_cancel_message(incoming);
+            }
+            break;
+          case MessageType.SNAPSHOT:
+            lastSeq.current = incoming.seq;
+            resumePending.current = false;
+            handle_snapshot_message(incoming);
+            break;
+          case MessageType.POSITION:
+            handle_position_message(incoming);
             break;
           case MessageType.ERROR:
             alert(incoming.error);
@@ -210,6 +331,17 @@ const AssetInterface = ({
     };
   }, [userInfo === undefined]);
 
+  // get_state only has our own orders, the whole book comes from a snapshot
+  // once there's a game state to put it in
+  const loaded = gameState !== undefined;
+  useEffect(() => {
+    if (!loaded || ws.current?.readyState !== WebSocket.OPEN) {
+      return;
+    }
+    const outgoing = { type: MessageType.SNAPSHOT } as OutgoingMessage;
+    ws.current.send(JSON.stringify(outgoing));
+  }, [loaded]);
+
   const place_order = (side: Side, price: number, volume: number) => {
     if (!ws.current) {
       console.error("ws.current not set, no order placed");
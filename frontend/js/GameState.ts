@@ -2,6 +2,7 @@ import Order from "./Order";
 
 type GameState = {
   error: string;
+  version: number;
   orders: { [key: string]: Order };
   cash: number;
   buying_power: number;
@@ -8,16 +8,56 @@ enum MessageType {
   ORDER = 1,
   CANCEL = 2,
   ERROR = 3,
+  BASKET = 4,
+  SNAPSHOT = 5,
+  RESUME = 6,
+  TICKER = 7,
+  PING = 8,
+  POSITION = 9,
 }
 
+type Ticker = {
+  last: number | undefined;
+  best_bid: number | undefined;
+  best_ask: number | undefined;
+  volume: number;
+  notional: number;
+  trades: number;
+};
+
+// Server monotonic clock, in nanoseconds
+type ServerTimes = {
+  received_ns: number;
+  matched_ns: number;
+  published_ns: number;
+};
+
+// The user's own balances on one book, newer than any state whose version
+// is lower
+type Position = {
+  version: number;
+  asset: Asset;
+  cash: number;
+  buying_power: number;
+  assets_held: number;
+  selling_power: number;
+};
+
 type IncomingMessage = {
   type: MessageType | undefined;
   error: string | undefined;
+  seq: number | undefined;
   user_id: number | undefined;
   username: string | undefined;
   trades: Trade[] | undefined;
   unmatched_order: Order | undefined;
   order_id: number | undefined;
+  orders: Order[] | undefined;
+  ticker: Ticker | undefined;
+  times: ServerTimes | undefined;
+  client_time: number | undefined;
+  server_ns: number | undefined;
+  position: Position | undefined;
 };
 
 type OutgoingMessage = {
@@ -29,6 +69,55 @@ type OutgoingMessage = {
   price: number | undefined;
   volume: number | undefined;
   order_id: number | undefined;
+  seq: number | undefined;
+  client_time: number | undefined;
 };
 
-export { MessageType, IncomingMessage, OutgoingMessage };
+const supportsDeflate = typeof DecompressionStream !== "undefined";
+
+// Must match DEFLATE_DICTIONARY in src/Deflate.hpp byte for byte
+const DEFLATE_DICTIONARY = new TextEncoder().encode(
+  '{"type":7,"ticker":{"last":,"best_bid":,"best_ask":,"volume":,"notional":,"trades":}}{"type":2,"seq":,"order_id":,"times":{"received_ns":{"type":1,"seq":,"trades":[{"buyer_id":,"seller_id":,"price":,"volume":,"order_id":}],"unmatched_order":{"asset":,"side":,"user_id":,"price":,"volume":,"order_id":},"times":{"received_ns":,"matched_ns":,"published_ns":}}',
+);
+
+// DecompressionStream takes no preset dictionary, so each frame is inflated
+// behind a stored deflate block holding it. That puts the dictionary in the
+// window the frame's matches point back into, and its bytes are dropped after.
+const DICTIONARY_BLOCK = (() => {
+  const length = DEFLATE_DICTIONARY.length;
+  const block = new Uint8Array(5 + length);
+  // Not the final block, stored, then LEN and its complement little endian
+  block.set([
+    0,
+    length & 0xff,
+    length >> 8,
+    ~length & 0xff,
+    (~length >> 8) & 0xff,
+  ]);
+  block.set(DEFLATE_DICTIONARY, 5);
+  return block;
+})();
+
+// On a /deflate path, frames past the server's threshold arrive as binary
+// raw deflate and everything else as text
+const decode = async (data: string | ArrayBuffer): Promise<string> => {
+  if (typeof data === "string") {
+    return data;
+  }
+  const inflated = new Blob([DICTIONARY_BLOCK, data])
+    .stream()
+    .pipeThrough(new DecompressionStream("deflate-raw"));
+  const bytes = new Uint8Array(await new Response(inflated).arrayBuffer());
+  return new TextDecoder().decode(bytes.subarray(DEFLATE_DICTIONARY.length));
+};
+
+export {
+  MessageType,
+  IncomingMessage,
+  OutgoingMessage,
+  Position,
+  ServerTimes,
+  Ticker,
+  decode,
+  supportsDeflate,
+};
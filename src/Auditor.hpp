@@ -0,0 +1,223 @@
+#pragma once
+
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <cstddef>
+#include <cstdint>
+#include <deque>
+#include <mutex>
+#include <string>
+#include <unordered_map>
+#include <vector>
+
+#include "Exchange.hpp"
+#include "Models.hpp"
+
+// Checks every user's buying and selling power against what their resting
+// orders reserve. The exchanges keep reservations up to date as orders rest,
+// fill and cancel, so an audit only reads balances. It never holds more than
+// one lock at a time: each book is checked under its own lock alone, and cash
+// under the cash lock alone, so matching on the other books carries on.
+//
+// Cash is the one check that spans books, since a user's cash is reserved by
+// buys on all of them. Each book's reservations are summed with the user's
+// state versions as the book is visited, then cash is compared. A mismatch is
+// only reported if a second visit finds none of that user's versions moved,
+// i.e. nothing of theirs changed while the books were being read one by one.
+// Users who were trading at the time are left to the next audit.
+
+struct AuditCut {
+  uint64_t reserved_cash{0};
+  // Sum of the user's per book state versions, which only ever go up
+  uint64_t version{0};
+};
+
+struct CashMismatch {
+  uint32_t user_id;
+  Cash cash;
+  uint64_t reserved_cash;
+  uint64_t version;
+};
+
+// Kept between audits so a warm audit allocates only for what it reports
+struct AuditScratch {
+  std::unordered_map<uint32_t, AuditCut> cuts;
+  std::vector<CashMismatch> mismatches;
+};
+
+struct AuditReport {
+  std::vector<std::string> violations;
+  // Longest any one lock was held, how long matching on that book waited
+  uint64_t max_pause_ns{0};
+  // Cash mismatches not reported because the user was trading meanwhile
+  uint64_t unsettled{0};
+};
+
+// Times one lock held by the audit
+struct AuditPause {
+  AuditReport& report;
+  std::chrono::steady_clock::time_point start;
+
+  explicit AuditPause(AuditReport& report)
+      : report(report), start(std::chrono::steady_clock::now()) {}
+  AuditPause(const AuditPause&) = delete;
+  auto operator=(const AuditPause&) -> AuditPause& = delete;
+
+  ~AuditPause() {
+    auto held = std::chrono::duration_cast<std::chrono::nanoseconds>(
+        std::chrono::steady_clock::now() - start);
+    report.max_pause_ns =
+        std::max(report.max_pause_ns, static_cast<uint64_t>(held.count()));
+  }
+};
+
+template <typename Book>
+auto inline audit_book(const Book& exchange, AuditScratch& scratch,
+                       AuditReport& report) -> void {
+  std::scoped_lock book_lock(exchange.book_mutex());
+  AuditPause pause{report};
+  for (const auto& [user_id, assets] : exchange.user_assets) {
+    uint32_t reserved_assets = 0;
+    if (auto it = exchange.reserved.find(user_id);
+        it != exchange.reserved.end()) {
+      reserved_assets = it->second.assets;
+    }
+    if (uint64_t{assets.amount_held} !=
+        uint64_t{assets.selling_power} + reserved_assets) {
+      report.violations.push_back(
+          "user_id " + std::to_string(user_id) + " holds " +
+          std::to_string(assets.amount_held) + " " +
+          to_string(exchange.asset) + " with selling power " +
+          std::to_string(assets.selling_power) + " and " +
+          std::to_string(reserved_assets) + " reserved by sell orders");
+    }
+  }
+  for (const auto& [user_id, reservation] : exchange.reserved) {
+    scratch.cuts[user_id].reserved_cash += reservation.cash;
+  }
+  for (const auto& [user_id, version] : exchange.state_versions) {
+    scratch.cuts[user_id].version += version;
+  }
+}
+
+template <typename Book>
+auto inline audit(const std::vector<Book>& exchanges, AuditScratch& scratch)
+    -> AuditReport {
+  AuditReport report;
+  // Zeroed rather than cleared so the nodes are reused
+  for (auto& [_, cut] : scratch.cuts) {
+    cut = {};
+  }
+  scratch.mismatches.clear();
+  for (const Book& exchange : exchanges) {
+    audit_book(exchange, scratch, report);
+  }
+
+  Ledger* ledger = exchanges.front().ledger;
+  {
+    std::scoped_lock cash_lock(ledger->cash_mutex);
+    AuditPause pause{report};
+    for (const auto& [user_id, cash] : ledger->user_cash) {
+      auto it = scratch.cuts.find(user_id);
+      AuditCut cut = it == scratch.cuts.end() ? AuditCut{} : it->second;
+      if (cash.amount_held != cash.buying_power + cut.reserved_cash) {
+        scratch.mismatches.push_back({.user_id = user_id,
+                                      .cash = cash,
+                                      .reserved_cash = cut.reserved_cash,
+                                      .version = cut.version});
+      }
+    }
+  }
+  if (scratch.mismatches.empty()) {
+    return report;
+  }
+
+  // Only users that looked wrong are visited again
+  std::vector<uint64_t> versions(scratch.mismatches.size(), 0);
+  for (const Book& exchange : exchanges) {
+    std::scoped_lock book_lock(exchange.book_mutex());
+    AuditPause pause{report};
+    for (size_t i = 0; i < scratch.mismatches.size(); ++i) {
+      if (auto it = exchange.state_versions.find(scratch.mismatches[i].user_id);
+          it != exchange.state_versions.end()) {
+        versions[i] += it->second;
+      }
+    }
+  }
+  for (size_t i = 0; i < scratch.mismatches.size(); ++i) {
+    const CashMismatch& mismatch = scratch.mismatches[i];
+    if (versions[i] != mismatch.version) {
+      ++report.unsettled;
+      continue;
+    }
+    report.violations.push_back(
+        "user_id " + std::to_string(mismatch.user_id) + " holds " +
+        std::to_string(mismatch.cash.amount_held) +
+        " cash with buying power " +
+        std::to_string(mismatch.cash.buying_power) + " and " +
+        std::to_string(mismatch.reserved_cash) + " reserved by buy orders");
+  }
+  return report;
+}
+
+template <typename Book>
+auto inline audit(const std::vector<Book>& exchanges)
+    -> std::vector<std::string> {
+  AuditScratch scratch;
+  return audit(exchanges, scratch).violations;
+}
+
+struct AuditMetrics {
+  uint64_t audits;
+  uint64_t violations;
+  uint64_t unsettled;
+  // Longest a book or the cash lock was held by an audit, the last one and
+  // the worst so far
+  uint64_t last_pause_ns;
+  uint64_t max_pause_ns;
+  std::vector<std::string> recent_violations;
+};
+
+// Running totals for one game, written by the audit thread and read by the
+// API
+struct AuditStats {
+  static constexpr size_t RECENT_VIOLATIONS = 16;
+
+  std::atomic<uint64_t> audits{0};
+  std::atomic<uint64_t> violations{0};
+  std::atomic<uint64_t> unsettled{0};
+  std::atomic<uint64_t> last_pause_ns{0};
+  std::atomic<uint64_t> max_pause_ns{0};
+  std::mutex recent_mutex;
+  std::deque<std::string> recent;
+
+  auto record(AuditReport report) -> void {
+    ++audits;
+    violations += report.violations.size();
+    unsettled += report.unsettled;
+    last_pause_ns = report.max_pause_ns;
+    // Only the audit thread writes
+    max_pause_ns = std::max(max_pause_ns.load(), report.max_pause_ns);
+    if (report.violations.empty()) {
+      return;
+    }
+    std::scoped_lock lock(recent_mutex);
+    for (std::string& violation : report.violations) {
+      recent.push_back(std::move(violation));
+      if (recent.size() > RECENT_VIOLATIONS) {
+        recent.pop_front();
+      }
+    }
+  }
+
+  auto metrics() -> AuditMetrics {
+    std::scoped_lock lock(recent_mutex);
+    return {.audits = audits,
+            .violations = violations,
+            .unsettled = unsettled,
+            .last_pause_ns = last_pause_ns,
+            .max_pause_ns = max_pause_ns,
+            .recent_violations = {recent.begin(), recent.end()}};
+  }
+};
@@ -0,0 +1,195 @@
+#pragma once
+
+#include <algorithm>
+#include <charconv>
+#include <cstddef>
+#include <cstdint>
+#include <cstdlib>
+#include <string>
+#include <string_view>
+#include <utility>
+#include <vector>
+
+// Reads a numeric environment variable, falling back when unset or malformed
+template <typename T>
+auto env_or(const char* name, T fallback) -> T {
+  const char* raw = std::getenv(name);
+  if (raw == nullptr) {
+    return fallback;
+  }
+  std::string_view str(raw);
+  T value{};
+  auto [ptr, ec] = std::from_chars(str.data(), str.data() + str.size(), value);
+  if (ec != std::errc{} || ptr != str.data() + str.size()) {
+    return fallback;
+  }
+  return value;
+}
+
+inline auto env_string(const char* name, std::string fallback) -> std::string {
+  const char* raw = std::getenv(name);
+  return raw == nullptr ? std::move(fallback) : std::string(raw);
+}
+
+// Reads a comma separated list like "2,3,4,5", skipping malformed entries
+inline auto env_list(const char* name) -> std::vector<int> {
+  std::vector<int> values;
+  const char* raw = std::getenv(name);
+  if (raw == nullptr) {
+    return values;
+  }
+  std::string_view str(raw);
+  while (!str.empty()) {
+    size_t end = std::min(str.find(','), str.size());
+    int value = 0;
+    auto [ptr, ec] = std::from_chars(str.data(), str.data() + end, value);
+    if (ec == std::errc{} && ptr == str.data() + end) {
+      values.push_back(value);
+    }
+    str.remove_prefix(std::min(end + 1, str.size()));
+  }
+  return values;
+}
+
+struct Config {
+  /* Per-connection token bucket */
+  double messages_per_second{50.0};
+  double message_burst{100.0};
+
+  /* Slow consumers are dropped from the topic above the soft limit and
+   * resynced with a snapshot once drained, and disconnected above the hard
+   * limit */
+  uint32_t backpressure_soft_limit{256 * 1024};
+  uint32_t backpressure_hard_limit{4 * 1024 * 1024};
+  uint32_t backpressure_check_ms{100};
+
+  /* Published messages kept per asset for clients resuming after a drop */
+  size_t replay_buffer_size{4096};
+
+  /* Frames sent to /deflate subscribers at least this long are compressed.
+   * With the preset dictionary a 200-300 byte order message comes out at
+   * 70-95 bytes and a 135 byte cancel at 55, below this it's barely worth
+   * the CPU */
+  size_t compress_threshold{96};
+
+  /* Shared memory feed for co-located consumers, see ShmFeed.hpp */
+  bool shm_feed{false};
+  uint64_t shm_feed_capacity{1 << 16};
+
+  /* Games hosted by this process. Exchange asset of game g listens on
+   * base_port + 4 * g + asset and serves only its own paths, whichever
+   * shard thread it's assigned to */
+  uint32_t games{1};
+  int base_port{9001};
+  int api_port{3000};
+  /* Candles served from /api/game/get_market, and how often each book's
+   * ticker is published when it has changed */
+  int64_t candle_interval_ms{5000};
+  size_t candle_history{720};
+  uint32_t ticker_interval_ms{1000};
+
+  /* One in every trace_sample messages is traced through the pipeline, 0
+   * turns tracing off. Each thread keeps its latest trace_buffer_size spans
+   * for /api/trace. */
+  uint32_t trace_sample{0};
+  size_t trace_buffer_size{1 << 16};
+
+  /* Keep every fill for /api/game/get_trades, see TradeTape.hpp */
+  bool trade_tape{true};
+
+  /* How often every game's balances are audited, 0 turns auditing off */
+  uint32_t audit_interval_ms{1000};
+
+  /* Frontend files and logged in sessions served by the API, an empty path
+   * turns either off */
+  std::string static_dir{"static"};
+  std::string sessions_file{"sessions.tsv"};
+
+  /* Standalone market data relay, see relay.cpp. It follows the exchanges at
+   * relay_upstream_host, on the listed port for each asset or else
+   * venue_port, and retries lost ones every
+   * relay_reconnect_ms */
+  int relay_port{9101};
+  std::string relay_upstream_host{"127.0.0.1"};
+  std::vector<int> relay_upstream_ports;
+  uint32_t relay_reconnect_ms{1000};
+
+  /* Cores the asset threads are pinned to, all of them when empty */
+  std::vector<int> cores;
+
+  /* Low latency mode, trading CPU for steadier tails. The API thread is left
+   * unpinned when api_core is negative, busy polling spins every loop instead
+   * of sleeping in epoll (a core and three syscalls per spin, see busy_poll),
+   * and prefault_orders warms each book for that many resting orders before
+   * memory is locked. */
+  int api_core{-1};
+  bool busy_poll{false};
+  bool lock_memory{false};
+  size_t prefault_orders{0};
+
+  /* Capacity plan. Every game's user tables are sized for expected_users
+   * before listening, and with huge_pages each book's nodes come from a
+   * prefaulted huge page arena sized for prefault_orders. */
+  size_t expected_users{0};
+  bool huge_pages{false};
+
+  [[nodiscard]] auto venue_port(uint32_t game_id, uint32_t asset) const
+      -> int {
+    return base_port + static_cast<int>(4 * game_id + asset);
+  }
+
+  static auto from_env() -> Config {
+    Config config{};
+    config.messages_per_second =
+        env_or("ZINGERS_MESSAGES_PER_SECOND", config.messages_per_second);
+    config.message_burst =
+        env_or("ZINGERS_MESSAGE_BURST", config.message_burst);
+    config.backpressure_soft_limit = env_or("ZINGERS_BACKPRESSURE_SOFT_LIMIT",
+                                            config.backpressure_soft_limit);
+    config.backpressure_hard_limit = env_or("ZINGERS_BACKPRESSURE_HARD_LIMIT",
+                                            config.backpressure_hard_limit);
+    config.backpressure_check_ms =
+        env_or("ZINGERS_BACKPRESSURE_CHECK_MS", config.backpressure_check_ms);
+    config.replay_buffer_size =
+        env_or("ZINGERS_REPLAY_BUFFER_SIZE", config.replay_buffer_size);
+    config.compress_threshold =
+        env_or("ZINGERS_COMPRESS_THRESHOLD", config.compress_threshold);
+    config.shm_feed = env_or("ZINGERS_SHM_FEED", 0) != 0;
+    config.shm_feed_capacity =
+        env_or("ZINGERS_SHM_FEED_CAPACITY", config.shm_feed_capacity);
+    config.games = std::max(env_or("ZINGERS_GAMES", config.games), 1U);
+    config.base_port = env_or("ZINGERS_BASE_PORT", config.base_port);
+    config.api_port = env_or("ZINGERS_API_PORT", config.api_port);
+    config.cores = env_list("ZINGERS_CORES");
+    config.api_core = env_or("ZINGERS_API_CORE", config.api_core);
+    config.busy_poll = env_or("ZINGERS_BUSY_POLL", 0) != 0;
+    config.lock_memory = env_or("ZINGERS_LOCK_MEMORY", 0) != 0;
+    config.prefault_orders =
+        env_or("ZINGERS_PREFAULT_ORDERS", config.prefault_orders);
+    config.expected_users =
+        env_or("ZINGERS_EXPECTED_USERS", config.expected_users);
+    config.huge_pages = env_or("ZINGERS_HUGE_PAGES", 0) != 0;
+    config.candle_interval_ms =
+        env_or("ZINGERS_CANDLE_INTERVAL_MS", config.candle_interval_ms);
+    config.candle_history =
+        env_or("ZINGERS_CANDLE_HISTORY", config.candle_history);
+    config.ticker_interval_ms = std::max(
+        env_or("ZINGERS_TICKER_INTERVAL_MS", config.ticker_interval_ms), 1U);
+    config.trace_sample = env_or("ZINGERS_TRACE_SAMPLE", config.trace_sample);
+    config.trace_buffer_size =
+        env_or("ZINGERS_TRACE_BUFFER_SIZE", config.trace_buffer_size);
+    config.trade_tape = env_or("ZINGERS_TRADE_TAPE", 1) != 0;
+    config.audit_interval_ms =
+        env_or("ZINGERS_AUDIT_INTERVAL_MS", config.audit_interval_ms);
+    config.static_dir = env_string("ZINGERS_STATIC_DIR", config.static_dir);
+    config.sessions_file =
+        env_string("ZINGERS_SESSIONS_FILE", config.sessions_file);
+    config.relay_port = env_or("ZINGERS_RELAY_PORT", config.relay_port);
+    config.relay_upstream_host =
+        env_string("ZINGERS_RELAY_UPSTREAM_HOST", config.relay_upstream_host);
+    config.relay_upstream_ports = env_list("ZINGERS_RELAY_UPSTREAM_PORTS");
+    config.relay_reconnect_ms = std::max(
+        env_or("ZINGERS_RELAY_RECONNECT_MS", config.relay_reconnect_ms), 1U);
+    return config;
+  }
+};
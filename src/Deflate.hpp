@@ -0,0 +1,113 @@
+#pragma once
+
+#include <cstddef>
+#include <string>
+#include <string_view>
+
+#include <zlib.h>
+
+// Field names of the messages published most, the most common last since
+// nearer matches cost fewer bits. Every frame starts from it, so even a
+// 130-byte cancel finds matches. Must match DEFLATE_DICTIONARY in
+// frontend/js/Message.ts byte for byte.
+constexpr std::string_view DEFLATE_DICTIONARY =
+    R"({"type":7,"ticker":{"last":,"best_bid":,"best_ask":,"volume":,)"
+    R"("notional":,"trades":}}{"type":2,"seq":,"order_id":,"times":)"
+    R"({"received_ns":{"type":1,"seq":,"trades":[{"buyer_id":,"seller_id":,)"
+    R"("price":,"volume":,"order_id":}],"unmatched_order":{"asset":,"side":,)"
+    R"("user_id":,"price":,"volume":,"order_id":},"times":{"received_ns":,)"
+    R"("matched_ns":,"published_ns":}})";
+
+// Raw deflate (RFC 1951) of a whole payload with no history carried between
+// payloads other than the preset dictionary, what a browser's
+// DecompressionStream("deflate-raw") reads once the dictionary is fed to it
+// first as a stored block. The stream and output buffer are reused, so a warm
+// Deflater never allocates.
+struct Deflater {
+  z_stream stream{};
+  std::string out;
+  std::string_view dictionary;
+
+  explicit Deflater(int level = Z_BEST_SPEED,
+                    std::string_view dictionary = {})
+      : dictionary(dictionary) {
+    deflateInit2(&stream, level, Z_DEFLATED, -MAX_WBITS, 8,
+                 Z_DEFAULT_STRATEGY);
+  }
+
+  Deflater(const Deflater&) = delete;
+  auto operator=(const Deflater&) -> Deflater& = delete;
+
+  ~Deflater() { deflateEnd(&stream); }
+
+  // Valid until the next call
+  auto compress(std::string_view in) -> std::string_view {
+    deflateReset(&stream);
+    if (!dictionary.empty()) {
+      deflateSetDictionary(
+          &stream, reinterpret_cast<const Bytef*>(dictionary.data()),
+          static_cast<uInt>(dictionary.size()));
+    }
+    out.resize(deflateBound(&stream, static_cast<uLong>(in.size())));
+    stream.next_in = reinterpret_cast<Bytef*>(const_cast<char*>(in.data()));
+    stream.avail_in = static_cast<uInt>(in.size());
+    stream.next_out = reinterpret_cast<Bytef*>(out.data());
+    stream.avail_out = static_cast<uInt>(out.size());
+    deflate(&stream, Z_FINISH);
+    return {out.data(), stream.total_out};
+  }
+};
+
+// A whole gzip member (RFC 1952), for HTTP bodies compressed ahead of time
+inline auto gzip(std::string_view in, int level = Z_BEST_COMPRESSION)
+    -> std::string {
+  z_stream stream{};
+  deflateInit2(&stream, level, Z_DEFLATED, MAX_WBITS + 16, 9,
+               Z_DEFAULT_STRATEGY);
+  std::string out(deflateBound(&stream, static_cast<uLong>(in.size())), '\0');
+  stream.next_in = reinterpret_cast<Bytef*>(const_cast<char*>(in.data()));
+  stream.avail_in = static_cast<uInt>(in.size());
+  stream.next_out = reinterpret_cast<Bytef*>(out.data());
+  stream.avail_out = static_cast<uInt>(out.size());
+  deflate(&stream, Z_FINISH);
+  out.resize(stream.total_out);
+  deflateEnd(&stream);
+  return out;
+}
+
+// Compresses into a per-thread buffer, valid until the next call on the same
+// thread
+inline auto deflate_raw(std::string_view in) -> std::string_view {
+  thread_local Deflater deflater(Z_BEST_SPEED, DEFLATE_DICTIONARY);
+  return deflater.compress(in);
+}
+
+// Publishes payload as is on topic and to deflate_topic's subscribers, if
+// any, compressed into a binary frame once it reaches threshold bytes. The
+// app copies the frame for every subscriber, so it's compressed only once.
+template <typename App, typename OpCode>
+auto publish_deflated(App* app, std::string_view topic,
+                      std::string_view deflate_topic, size_t threshold,
+                      std::string_view payload, OpCode op_code) -> void {
+  app->publish(topic, payload, op_code);
+  if (app->numSubscribers(deflate_topic) == 0) {
+    return;
+  }
+  if (payload.size() < threshold) {
+    app->publish(deflate_topic, payload, op_code);
+    return;
+  }
+  app->publish(deflate_topic, deflate_raw(payload), OpCode::BINARY);
+}
+
+// Sends payload to one socket the way publish_deflated would have, for
+// snapshots and replays
+template <typename WebSocket, typename OpCode>
+auto send_deflated(WebSocket* ws, bool deflate, size_t threshold,
+                   std::string_view payload, OpCode op_code) -> void {
+  if (!deflate || payload.size() < threshold) {
+    ws->send(payload, op_code);
+    return;
+  }
+  ws->send(deflate_raw(payload), OpCode::BINARY);
+}
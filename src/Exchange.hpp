@@ -1,121 +1,213 @@
 #pragma once
 
+#include <algorithm>
 #include <array>
 #include <atomic>
 #include <cassert>
 #include <cstdint>
 #include <iostream>
-#include <list>
+#include <memory>
+#include <memory_resource>
 #include <mutex>
 #include <optional>
 #include <ostream>
+#include <span>
+#include <string>
+#include <string_view>
 #include <unordered_map>
+#include <utility>
 #include <vector>
 
+#include "FeedOutbox.hpp"
+#include "HugePageArena.hpp"
+#include "MarketStats.hpp"
 #include "Models.hpp"
+#include "PriceGrid.hpp"
+#include "ShmFeed.hpp"
+#include "Trace.hpp"
+#include "TradeTape.hpp"
 
-struct Exchange {
-  /* Used by all instances of Exchange */
-  static inline std::unordered_map<uint32_t, Cash> user_cash;
-  static inline std::mutex cash_mutex;
-  static inline std::atomic_uint32_t order_number{0};
+// State shared by the exchanges of one game
+struct Ledger {
+  std::unordered_map<uint32_t, Cash> user_cash;
+  // Goes up with every change to a user's cash, assets or orders on any book,
+  // so it's read under cash_mutex alone. See BasicExchange::touch.
+  std::unordered_map<uint32_t, uint64_t> state_versions;
+  std::mutex cash_mutex;
+  std::atomic_uint32_t order_number{0};
+  /* One lock per book, only contended when a basket spans several books */
+  std::array<std::mutex, ASSET_VALUES.size()> book_mutexes;
+};
+
+// Matching for one asset, laid out by the Grid policy from PriceGrid.hpp
+template <typename Grid>
+struct BasicExchange {
+
+  using Level = PriceLevel;
 
   /* Per-exchange information */
   Asset asset;
+  Ledger* ledger;
+  // Where the pool gets its memory when the game is planned for huge pages,
+  // the heap otherwise
+  std::unique_ptr<HugePageArena> arena;
+  // Book nodes are recycled through this pool so a steady-state book doesn't
+  // hit malloc, held by pointer so the address survives moving the Exchange
+  std::unique_ptr<std::pmr::unsynchronized_pool_resource> pool;
   std::unordered_map<uint32_t, AssetAmount> user_assets;
-  std::array<std::list<Order>, MAX_PRICE + 1> buy_orders;
-  std::array<std::list<Order>, MAX_PRICE + 1> sell_orders;
-  std::unordered_map<uint32_t, std::list<Order>::iterator> all_orders;
-
-  Exchange(Asset asset) : asset(asset) {}
-
-  static auto verify_state(uint32_t user_id,
-                           const std::vector<Exchange>& exchanges) -> void {
-    std::lock_guard lg(cash_mutex);
-    uint32_t expected_buying_power = user_cash.at(user_id).amount_held;
-    for (const auto& exchange : exchanges) {
-      for (uint32_t price = MIN_PRICE; price <= MAX_PRICE; ++price) {
-        for (const auto& order : exchange.buy_orders[price]) {
-          assert(order.price == price);
-          if (order.user_id == user_id) {
-            expected_buying_power -= order.volume * order.price;
-          }
-        }
-      }
+  // What each user's resting orders on this book hold back, kept alongside
+  // the powers they reduce so the auditor can check one against the other
+  std::unordered_map<uint32_t, Reservation> reserved;
+  // Counts changes to each user's cash, assets or orders made on this book.
+  // See Game::state_version.
+  std::unordered_map<uint32_t, uint64_t> state_versions;
+  Grid buy_orders;
+  Grid sell_orders;
+  std::pmr::unordered_map<uint32_t, Level::iterator> all_orders;
+  // Backs the trades span returned by place_order, reused between orders
+  std::vector<Trade> trades_buffer;
+  // Optional shared memory feed, only written while holding book_mutex()
+  ShmFeedWriter* shm_feed{nullptr};
+  MarketStats stats;
+  // Optional history of every fill, appended while holding book_mutex()
+  TradeTape* tape{nullptr};
+  // Optional list of users whose state changed, appended to while holding
+  // book_mutex() and drained by whoever pushes their updates
+  std::vector<uint32_t>* changed_users{nullptr};
+  // Optional market data sequencer, appended to while holding book_mutex()
+  FeedOutbox* outbox{nullptr};
+
+  BasicExchange(Asset asset, Ledger& ledger,
+                std::unique_ptr<HugePageArena> arena = {})
+      : asset(asset),
+        ledger(&ledger),
+        arena(std::move(arena)),
+        pool(std::make_unique<std::pmr::unsynchronized_pool_resource>(
+            this->arena ? this->arena.get()
+                        : std::pmr::get_default_resource())),
+        buy_orders(BUY, pool.get()),
+        sell_orders(SELL, pool.get()),
+        all_orders(pool.get()) {}
+
+  static inline const std::string PRICE_RANGE_ERROR =
+      "Price must be in range [" + std::to_string(Grid::MIN) + ", " +
+      std::to_string(Grid::MAX) + "] inclusive";
+
+  static constexpr std::array<std::string_view, ASSET_VALUES.size()>
+      INSUFFICIENT_ASSET_ERRORS = {
+          "Insufficient asset DRESSING for order.",
+          "Insufficient asset RYE for order.",
+          "Insufficient asset SWISS for order.",
+          "Insufficient asset PASTRAMI for order.",
+      };
+
+  // Arena size for `orders` resting orders: a list node and an all_orders
+  // node and bucket each, doubled for the pool's chunk growth
+  static constexpr auto arena_bytes(size_t orders) -> size_t {
+    constexpr size_t per_order =
+        sizeof(Order) + 2 * sizeof(void*) + 4 * sizeof(void*);
+    return 2 * orders * per_order;
+  }
+
+  // Sizes the user tables for `users` and touches the pool and hash table
+  // for `orders` resting orders up front, so the first busy minutes of a game
+  // don't rehash or page fault inside the lock
+  auto prefault(size_t users, size_t orders) -> void {
+    std::scoped_lock book_lock(book_mutex());
+    user_assets.reserve(users);
+    reserved.reserve(users);
+    state_versions.reserve(users);
+    {
+      std::scoped_lock cash_lock(ledger->cash_mutex);
+      ledger->state_versions.reserve(users);
     }
-    if (expected_buying_power != user_cash[user_id].buying_power) {
-      std::cout << "user_id: " << user_id << '\n';
-      std::cout << "Expected buying power: " << expected_buying_power << '\n';
-      std::cout << "Actual buying power: " << user_cash[user_id].buying_power
-                << '\n';
-    }
-    assert(expected_buying_power == user_cash[user_id].buying_power);
-    for (const auto& exchange : exchanges) {
-      uint32_t expected_selling_power =
-          exchange.user_assets.at(user_id).amount_held;
-      for (uint32_t price = MIN_PRICE; price <= MAX_PRICE; ++price) {
-        for (const auto& order : exchange.sell_orders[price]) {
-          assert(order.price == price);
-          if (order.user_id == user_id) {
-            expected_selling_power -= order.volume;
-          }
-        }
-      }
-      if (expected_selling_power !=
-          exchange.user_assets.at(user_id).selling_power) {
-        std::cout << "user_id: " << user_id << '\n';
-        std::cout << "Expected selling power: " << expected_selling_power
-                  << '\n';
-        std::cout << "Actual selling power: "
-                  << exchange.user_assets.at(user_id).selling_power << '\n';
-      }
-      assert(expected_selling_power ==
-             exchange.user_assets.at(user_id).selling_power);
+    all_orders.reserve(all_orders.size() + orders);
+    trades_buffer.reserve(std::max(trades_buffer.capacity(), orders));
+    // Freed nodes stay in the pool's free lists for the real book to reuse,
+    // both the level's and the index's
+    Level warmup(pool.get());
+    decltype(all_orders) warmup_index(pool.get());
+    for (size_t i = 0; i < orders; ++i) {
+      auto node = warmup.emplace(warmup.end(), asset, BUY, 0, 0, 0, 0);
+      warmup_index.emplace(static_cast<uint32_t>(i), node);
     }
   }
 
-  static auto verify_state(const std::vector<Exchange>& exchanges) -> void {
-    for (auto [user_id, _] : user_cash) {
-      std::cout << user_id << '\n';
-      verify_state(user_id, exchanges);
-    }
+  [[nodiscard]] auto best_price(Side side) const -> std::optional<uint32_t> {
+    return (side == BUY ? buy_orders : sell_orders).best();
+  }
+
+  [[nodiscard]] auto ticker() const -> Ticker {
+    std::scoped_lock book_lock(book_mutex());
+    Ticker ticker = stats.ticker;
+    ticker.best_bid = best_price(BUY);
+    ticker.best_ask = best_price(SELL);
+    return ticker;
+  }
+
+  [[nodiscard]] auto market_summary() const -> MarketSummary {
+    std::scoped_lock book_lock(book_mutex());
+    MarketSummary summary{.ticker = stats.ticker, .candles = stats.history()};
+    summary.ticker.best_bid = best_price(BUY);
+    summary.ticker.best_ask = best_price(SELL);
+    return summary;
+  }
+
+  [[nodiscard]] auto book_mutex() const -> std::mutex& {
+    return ledger->book_mutexes[asset];
   }
 
   auto register_user(uint32_t user_id, uint32_t cash, uint32_t assets) -> void {
-    std::scoped_lock lock(cash_mutex);
+    std::scoped_lock lock(book_mutex(), ledger->cash_mutex);
     if (user_assets.contains(user_id)) {
       return;
     }
-    if (!user_cash.contains(user_id)) {
-      user_cash[user_id] = {.amount_held = cash, .buying_power = cash};
+    if (!ledger->user_cash.contains(user_id)) {
+      ledger->user_cash[user_id] = {.amount_held = cash, .buying_power = cash};
     }
     user_assets[user_id] = {.amount_held = assets, .selling_power = assets};
+    reserved[user_id] = {};
+    state_versions[user_id] = 0;
+    touch(user_id);
+  }
+
+  // Called with the book and cash locks held whenever something of user_id's
+  // changes
+  auto touch(uint32_t user_id) -> void {
+    ++state_versions[user_id];
+    ++ledger->state_versions[user_id];
+    if (changed_users != nullptr) {
+      changed_users->push_back(user_id);
+    }
   }
 
   [[nodiscard]] auto validate_order(Side side, uint32_t user_id, uint32_t price,
                                     uint32_t volume) const
-      -> std::optional<std::string> {
-    if (!user_cash.contains(user_id)) {
-      return "User with id " + std::to_string(user_id) + " not found.";
+      -> std::optional<std::string_view> {
+    if (!ledger->user_cash.contains(user_id)) {
+      return "User not found.";
     }
 
     switch (side) {
       case BUY: {
-        std::scoped_lock lock(cash_mutex);
-        if (price * volume > user_cash.at(user_id).buying_power) {
+        TraceSpan wait("wait cash_mutex");
+        std::scoped_lock lock(ledger->cash_mutex);
+        wait.end();
+        if (uint64_t{price} * volume >
+            ledger->user_cash.at(user_id).buying_power) {
           return "Insufficient buying power for order.";
         }
         break;
       }
       case SELL:
         if (volume > user_assets.at(user_id).selling_power) {
-          return "Insufficient asset " + to_string(asset) + " for order.";
+          return INSUFFICIENT_ASSET_ERRORS[asset];
         }
         break;
     }
 
-    if (price < MIN_PRICE || price > MAX_PRICE) {
-      return "Price must be in range [1, 200] inclusive";
+    if (price < Grid::MIN || price > Grid::MAX) {
+      return PRICE_RANGE_ERROR;
     }
 
     if (volume <= 0) {
@@ -125,19 +217,24 @@ struct Exchange {
     return {};
   }
 
+  // A prepaid taker's buying power was already taken when its basket started
   [[nodiscard]] auto execute_trade(Side taker_side, uint32_t maker_id,
                                    uint32_t taker_id, uint32_t price,
-                                   uint32_t volume, uint32_t order_id)
-      -> Trade {
-    std::scoped_lock lock(cash_mutex);
+                                   uint32_t volume, uint32_t order_id,
+                                   bool prepaid = false) -> Trade {
+    TraceSpan wait("wait cash_mutex");
+    std::scoped_lock lock(ledger->cash_mutex);
+    wait.end();
 
     uint32_t order_cost = price * volume;
     switch (taker_side) {
       case BUY:
-        user_cash[maker_id].amount_held += order_cost;
-        user_cash[maker_id].buying_power += order_cost;
-        user_cash[taker_id].amount_held -= order_cost;
-        user_cash[taker_id].buying_power -= order_cost;
+        ledger->user_cash[maker_id].amount_held += order_cost;
+        ledger->user_cash[maker_id].buying_power += order_cost;
+        ledger->user_cash[taker_id].amount_held -= order_cost;
+        if (!prepaid) {
+          ledger->user_cash[taker_id].buying_power -= order_cost;
+        }
 
         user_assets[maker_id].amount_held -= volume;
         /*user_assets[maker_id].selling_power -= volume;*/
@@ -145,10 +242,10 @@ struct Exchange {
         user_assets[taker_id].selling_power += volume;
         break;
       case SELL:
-        user_cash[maker_id].amount_held -= order_cost;
-        /*user_cash[maker_id].buying_power -= order_cost;*/
-        user_cash[taker_id].amount_held += order_cost;
-        user_cash[taker_id].buying_power += order_cost;
+        ledger->user_cash[maker_id].amount_held -= order_cost;
+        /*ledger->user_cash[maker_id].buying_power -= order_cost;*/
+        ledger->user_cash[taker_id].amount_held += order_cost;
+        ledger->user_cash[taker_id].buying_power += order_cost;
 
         user_assets[maker_id].amount_held += volume;
         user_assets[maker_id].selling_power += volume;
@@ -156,140 +253,334 @@ struct Exchange {
         user_assets[taker_id].selling_power -= volume;
         break;
     }
-    return {.buyer_id = taker_side == BUY ? taker_id : maker_id,
-            .seller_id = taker_side == BUY ? maker_id : taker_id,
-            .price = price,
-            .volume = volume,
-            .order_id = order_id};
+    touch(maker_id);
+    touch(taker_id);
+    int64_t now_ms = MarketStats::now_ms();
+    stats.on_trade(price, volume, now_ms);
+    Trade trade{.buyer_id = taker_side == BUY ? taker_id : maker_id,
+                .seller_id = taker_side == BUY ? maker_id : taker_id,
+                .price = price,
+                .volume = volume,
+                .order_id = order_id};
+    if (tape != nullptr) {
+      tape->append(trade, now_ms);
+    }
+    return trade;
   }
 
-  [[nodiscard]] auto match_order(Side side, uint32_t user_id, uint32_t price,
-                                 uint32_t& volume)
-      -> std::optional<std::vector<Trade>> {
-    std::vector<Trade> trades;
-
+  // Appends fills to `trades`, callers own the buffer so a basket running on
+  // another thread never writes into this exchange's trades_buffer
+  auto match_order(Side side, uint32_t user_id, uint32_t price,
+                   uint32_t& volume, std::vector<Trade>& trades,
+                   bool prepaid = false) -> void {
     auto& opposing_orders = side == BUY ? sell_orders : buy_orders;
 
-    auto cmp = [side](uint32_t lhs, uint32_t rhs) -> bool {
-      return side == BUY ? lhs >= rhs : lhs <= rhs;
-    };
-
-    for (uint32_t curr_price = side == BUY ? MIN_PRICE : MAX_PRICE;
-         volume > 0 && cmp(price, curr_price);
-         side == BUY ? ++curr_price : --curr_price) {
-      auto& level = opposing_orders[curr_price];
+    opposing_orders.drain([&](uint32_t level_price, Level& level) -> bool {
+      if (side == BUY ? level_price > price : level_price < price) {
+        return false;
+      }
       while (volume > 0 && !level.empty()) {
         auto iter = level.begin();
         uint32_t trade_volume = std::min(volume, iter->volume);
         volume -= trade_volume;
         iter->volume -= trade_volume;
+        if (side == BUY) {
+          reserved[iter->user_id].assets -= trade_volume;
+        } else {
+          reserved[iter->user_id].cash -= uint64_t{iter->price} * trade_volume;
+        }
         trades.push_back(execute_trade(side, iter->user_id, user_id,
                                        iter->price, trade_volume,
-                                       iter->order_id));
+                                       iter->order_id, prepaid));
+        if (shm_feed != nullptr) {
+          shm_feed->on_trade(trades.back());
+        }
         if (iter->volume == 0) {
           all_orders.erase(iter->order_id);
           level.erase(iter);
         }
       }
-    }
-
-    if (trades.empty()) {
-      return {};
-    }
-
-    return trades;
+      return volume > 0;
+    });
   }
 
+  // received_ns only stamps the outbox event
   [[nodiscard]] auto place_order(Side side, uint32_t user_id, uint32_t price,
-                                 uint32_t volume) -> OrderResult {
-    std::optional<std::string> error =
+                                 uint32_t volume, int64_t received_ns = 0)
+      -> OrderResult {
+    TraceSpan span("place_order");
+    TraceSpan wait("wait book_mutex");
+    std::scoped_lock book_lock(book_mutex());
+    wait.end();
+    TraceSpan validate("validate");
+    std::optional<std::string_view> error =
         validate_order(side, user_id, price, volume);
+    validate.end();
     if (error.has_value()) {
       return {.error = error, .trades = {}, .unmatched_order = {}};
     }
 
-    std::optional<std::vector<Trade>> trades =
-        match_order(side, user_id, price, volume);
+    TraceSpan match("match");
+    trades_buffer.clear();
+    match_order(side, user_id, price, volume, trades_buffer);
+    match.end();
 
     if (volume == 0) {
-      return {.error = {}, .trades = trades, .unmatched_order = {}};
+      if (shm_feed != nullptr) {
+        shm_feed->on_filled(side, user_id, price);
+      }
+      if (outbox != nullptr) {
+        outbox->push_order(trades_buffer, {}, received_ns);
+      }
+      return {.error = {}, .trades = trades_buffer, .unmatched_order = {}};
     }
 
+    TraceSpan insert("insert");
+    uint32_t order_id = ledger->order_number++;
+    TraceSpan wait_cash("wait cash_mutex");
+    std::unique_lock cash_lock(ledger->cash_mutex);
+    wait_cash.end();
     switch (side) {
       case BUY: {
-        std::scoped_lock lock(cash_mutex);
-        user_cash[user_id].buying_power -= price * volume;
-        buy_orders[price].emplace_back(asset, side, user_id, price, volume,
-                                       order_number);
-        all_orders[order_number] = std::prev(buy_orders[price].end());
+        ledger->user_cash[user_id].buying_power -= price * volume;
+        reserved[user_id].cash += uint64_t{price} * volume;
+        Level& level = buy_orders.level(price);
+        level.emplace_back(asset, side, user_id, price, volume, order_id);
+        all_orders[order_id] = std::prev(level.end());
         break;
       }
-      case SELL:
+      case SELL: {
         user_assets[user_id].selling_power -= volume;
-        sell_orders[price].emplace_back(asset, side, user_id, price, volume,
-                                        order_number);
-        all_orders[order_number] = std::prev(sell_orders[price].end());
+        reserved[user_id].assets += volume;
+        Level& level = sell_orders.level(price);
+        level.emplace_back(asset, side, user_id, price, volume, order_id);
+        all_orders[order_id] = std::prev(level.end());
         break;
+      }
     }
 
+    touch(user_id);
+    cash_lock.unlock();
+    insert.end();
+
+    Order unmatched_order{asset, side, user_id, price, volume, order_id};
+    if (shm_feed != nullptr) {
+      shm_feed->on_order(unmatched_order);
+    }
+    if (outbox != nullptr) {
+      outbox->push_order(trades_buffer, unmatched_order, received_ns);
+    }
     return {.error = {},
-            .trades = trades,
-            .unmatched_order =
-                Order{asset, side, user_id, price, volume, order_number++}};
+            .trades = trades_buffer,
+            .unmatched_order = unmatched_order};
   }
 
-  [[nodiscard]] auto cancel_order(uint32_t order_id)
-      -> std::optional<std::string> {
+  [[nodiscard]] auto cancel_order(uint32_t order_id, int64_t received_ns = 0)
+      -> std::optional<std::string_view> {
+    TraceSpan span("cancel_order");
+    TraceSpan wait("wait book_mutex");
+    std::scoped_lock book_lock(book_mutex());
+    wait.end();
     if (!all_orders.contains(order_id)) {
       return "Order not found.";
     }
     auto order_iter = all_orders[order_id];
+    if (shm_feed != nullptr) {
+      shm_feed->on_cancel(*order_iter);
+    }
+    if (outbox != nullptr) {
+      outbox->push_cancel(order_id, received_ns);
+    }
+    std::scoped_lock cash_lock(ledger->cash_mutex);
+    touch(order_iter->user_id);
     switch (order_iter->side) {
       case BUY: {
-        std::scoped_lock lock(cash_mutex);
-        user_cash[order_iter->user_id].buying_power +=
+        ledger->user_cash[order_iter->user_id].buying_power +=
             order_iter->price * order_iter->volume;
-        buy_orders[order_iter->price].erase(order_iter);
+        reserved[order_iter->user_id].cash -=
+            uint64_t{order_iter->price} * order_iter->volume;
+        buy_orders.remove(order_iter);
         break;
       }
       case SELL:
         user_assets[order_iter->user_id].selling_power += order_iter->volume;
-        sell_orders[order_iter->price].erase(order_iter);
+        reserved[order_iter->user_id].assets -= order_iter->volume;
+        sell_orders.remove(order_iter);
         break;
     }
     all_orders.erase(order_id);
     return {};
   }
-};
 
-auto inline operator<<(std::ostream& os, const Exchange& exchange)
-    -> std::ostream& {
-  os << to_string(exchange.asset) << " exchange" << '\n';
-  os << "  BUY orders: " << '\n';
-  for (uint32_t price = MAX_PRICE; price >= MIN_PRICE; --price) {
-    const auto& orders = exchange.buy_orders[price];
-    if (orders.empty()) {
-      continue;
+  // Every resting order, bids from best to worst then asks from best to worst
+  [[nodiscard]] auto snapshot() const -> std::vector<Order> {
+    std::scoped_lock book_lock(book_mutex());
+    return resting_orders();
+  }
+
+  // A snapshot along with the outbox seq of the last event it reflects,
+  // taken together so events up to that seq can be told apart from newer ones
+  [[nodiscard]] auto sequenced_snapshot() const
+      -> std::pair<std::vector<Order>, uint64_t> {
+    std::scoped_lock book_lock(book_mutex());
+    return {resting_orders(), outbox == nullptr ? 0 : outbox->seq};
+  }
+
+  [[nodiscard]] auto resting_orders() const -> std::vector<Order> {
+    std::vector<Order> orders;
+    orders.reserve(all_orders.size());
+    auto append = [&orders](uint32_t /*price*/, const Level& level) -> bool {
+      orders.insert(orders.end(), level.begin(), level.end());
+      return true;
+    };
+    buy_orders.for_each(append);
+    sell_orders.for_each(append);
+    return orders;
+  }
+
+  // Volume resting on the opposing side at prices that cross `price`, stops
+  // counting once `volume` is reached.
+  [[nodiscard]] auto fillable_volume(Side side, uint32_t price,
+                                     uint32_t volume) const -> uint32_t {
+    const auto& opposing_orders = side == BUY ? sell_orders : buy_orders;
+    uint32_t fillable = 0;
+    opposing_orders.for_each(
+        [&](uint32_t level_price, const Level& level) -> bool {
+          if (side == BUY ? level_price > price : level_price < price) {
+            return false;
+          }
+          for (const Order& order : level) {
+            fillable += order.volume;
+            if (fillable >= volume) {
+              return false;
+            }
+          }
+          return true;
+        });
+    return fillable;
+  }
+
+  // Executes every leg against its book as a single all-or-none unit. Books
+  // are locked in asset order so baskets can't deadlock with each other, and
+  // single orders only ever hold their own book's lock.
+  [[nodiscard]] static auto place_basket(std::vector<BasicExchange>& exchanges,
+                                         uint32_t user_id,
+                                         const std::vector<BasketLeg>& legs,
+                                         int64_t received_ns = 0)
+      -> BasketResult {
+    Ledger* ledger = exchanges.front().ledger;
+    if (legs.empty()) {
+      return {.error = "Basket must contain at least one leg.", .trades = {}};
     }
-    os << "    $" << price << '\n';
-    for (const Order& order : orders) {
-      os << "      order_id: " << order.order_id
-         << ", user_id: " << order.user_id << ", volume: " << order.volume
-         << '\n';
+
+    std::array<bool, ASSET_VALUES.size()> in_basket{};
+    for (const BasketLeg& leg : legs) {
+      if (leg.asset >= exchanges.size() || in_basket[leg.asset]) {
+        return {.error = "Basket must contain at most one leg per asset.",
+                .trades = {}};
+      }
+      in_basket[leg.asset] = true;
     }
-  }
-  os << "  SELL orders: " << '\n';
-  for (uint32_t price = MIN_PRICE; price <= MAX_PRICE; ++price) {
-    const auto& orders = exchange.sell_orders[price];
-    if (orders.empty()) {
-      continue;
+
+    std::vector<std::unique_lock<std::mutex>> book_locks;
+    book_locks.reserve(legs.size());
+    for (size_t i = 0; i < in_basket.size(); ++i) {
+      if (in_basket[i]) {
+        book_locks.emplace_back(ledger->book_mutexes[i]);
+      }
+    }
+
+    uint64_t basket_cost = 0;
+    for (const BasketLeg& leg : legs) {
+      const BasicExchange& exchange = exchanges[leg.asset];
+      assert(exchange.asset == leg.asset);
+      if (!exchange.user_assets.contains(user_id)) {
+        return {.error = "Not registered on exchange " +
+                         to_string_lower(exchange.asset),
+                .trades = {}};
+      }
+      std::optional<std::string_view> error =
+          exchange.validate_order(leg.side, user_id, leg.price, leg.volume);
+      if (error.has_value()) {
+        return {.error = std::string(error.value()), .trades = {}};
+      }
+      if (exchange.fillable_volume(leg.side, leg.price, leg.volume) <
+          leg.volume) {
+        return {.error = "Insufficient liquidity on " + to_string(leg.asset) +
+                         " to fill basket.",
+                .trades = {}};
+      }
+      if (leg.side == BUY) {
+        basket_cost += uint64_t{leg.price} * leg.volume;
+      }
     }
+
+    // Taken out before the legs run so an order on a book outside the basket
+    // can't spend it in the meantime, fills at better prices are handed back
+    BasicExchange& first = exchanges[legs.front().asset];
+    {
+      std::scoped_lock lock(ledger->cash_mutex);
+      Cash& cash = ledger->user_cash.at(user_id);
+      if (basket_cost > cash.buying_power) {
+        return {.error = "Insufficient buying power for basket.",
+                .trades = {}};
+      }
+      cash.buying_power -= static_cast<uint32_t>(basket_cost);
+      first.touch(user_id);
+    }
+
+    BasketResult result{.error = {}, .trades = {}};
+    result.trades.reserve(legs.size());
+    uint64_t spent = 0;
+    for (const BasketLeg& leg : legs) {
+      uint32_t volume = leg.volume;
+      BasicExchange& exchange = exchanges[leg.asset];
+      exchange.match_order(leg.side, user_id, leg.price, volume,
+                           result.trades.emplace_back(), true);
+      assert(volume == 0);
+      if (leg.side == BUY) {
+        for (const Trade& trade : result.trades.back()) {
+          spent += uint64_t{trade.price} * trade.volume;
+        }
+      }
+      if (exchange.shm_feed != nullptr) {
+        exchange.shm_feed->on_filled(leg.side, user_id, leg.price);
+      }
+      // Sequenced on the leg's book now, while its lock is still held
+      if (exchange.outbox != nullptr) {
+        exchange.outbox->push_order(result.trades.back(), {}, received_ns);
+      }
+    }
+
+    if (spent < basket_cost) {
+      std::scoped_lock lock(ledger->cash_mutex);
+      ledger->user_cash.at(user_id).buying_power +=
+          static_cast<uint32_t>(basket_cost - spent);
+      first.touch(user_id);
+    }
+    return result;
+  }
+};
+
+// Chosen by price range, MIN_PRICE to MAX_PRICE keeps the dense layout
+using Exchange = BasicExchange<PriceGrid<MIN_PRICE, MAX_PRICE>>;
+
+template <typename Grid>
+auto operator<<(std::ostream& os, const BasicExchange<Grid>& exchange)
+    -> std::ostream& {
+  auto print_level = [&os](uint32_t price, const PriceLevel& orders) -> bool {
     os << "    $" << price << '\n';
     for (const Order& order : orders) {
       os << "      order_id: " << order.order_id
          << ", user_id: " << order.user_id << ", volume: " << order.volume
          << '\n';
     }
-  }
+    return true;
+  };
+  os << to_string(exchange.asset) << " exchange" << '\n';
+  os << "  BUY orders: " << '\n';
+  exchange.buy_orders.for_each(print_level);
+  os << "  SELL orders: " << '\n';
+  exchange.sell_orders.for_each(print_level);
   return os;
 }
@@ -0,0 +1,85 @@
+#pragma once
+
+#include <cstdint>
+#include <functional>
+#include <optional>
+#include <span>
+#include <vector>
+
+#include "Models.hpp"
+
+// Market data events in the order one book produced them. The exchange
+// appends while holding its book lock and hands out the feed's seq right
+// there, whichever thread did the matching, and the venue's own thread
+// drains and publishes them in order. A basket matched from another book's
+// thread is sequenced exactly where it executed, so the feed always reads in
+// match order. Both vectors keep their capacity, so a warm outbox doesn't
+// allocate.
+
+struct OutboxEvent {
+  // ORDER or CANCEL
+  MessageType type;
+  uint64_t seq;
+  // Fills in [trades_begin, trades_end) of the outbox's trades
+  uint32_t trades_begin;
+  uint32_t trades_end;
+  std::optional<Order> unmatched_order;
+  // The cancelled order
+  uint32_t order_id;
+  int64_t received_ns;
+  int64_t matched_ns;
+};
+
+struct FeedOutbox {
+  // Last seq handed out, only touched under the book lock
+  uint64_t seq{0};
+  std::vector<OutboxEvent> events;
+  std::vector<Trade> trades;
+  // Set before trading starts, called by a thread that appended to another
+  // venue's outbox once it has released the book lock
+  std::function<void()> notify;
+
+  auto push_order(std::span<const Trade> fills,
+                  const std::optional<Order>& unmatched_order,
+                  int64_t received_ns) -> void {
+    auto begin = static_cast<uint32_t>(trades.size());
+    trades.insert(trades.end(), fills.begin(), fills.end());
+    events.push_back({.type = ORDER,
+                      .seq = ++seq,
+                      .trades_begin = begin,
+                      .trades_end = static_cast<uint32_t>(trades.size()),
+                      .unmatched_order = unmatched_order,
+                      .order_id = 0,
+                      .received_ns = received_ns,
+                      .matched_ns = monotonic_ns()});
+  }
+
+  auto push_cancel(uint32_t order_id, int64_t received_ns) -> void {
+    events.push_back({.type = CANCEL,
+                      .seq = ++seq,
+                      .trades_begin = 0,
+                      .trades_end = 0,
+                      .unmatched_order = {},
+                      .order_id = order_id,
+                      .received_ns = received_ns,
+                      .matched_ns = monotonic_ns()});
+  }
+
+  [[nodiscard]] auto fills(const OutboxEvent& event) const
+      -> std::span<const Trade> {
+    return std::span(trades).subspan(event.trades_begin,
+                                     event.trades_end - event.trades_begin);
+  }
+
+  // Trades the pending events for `drained`'s emptied buffers, under the
+  // book lock
+  auto take(FeedOutbox& drained) -> void {
+    events.swap(drained.events);
+    trades.swap(drained.trades);
+  }
+
+  auto clear() -> void {
+    events.clear();
+    trades.clear();
+  }
+};
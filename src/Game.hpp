@@ -0,0 +1,154 @@
+#pragma once
+
+#include <algorithm>
+#include <atomic>
+#include <cstdint>
+#include <functional>
+#include <memory>
+#include <mutex>
+#include <optional>
+#include <string>
+#include <string_view>
+#include <unordered_map>
+#include <utility>
+#include <vector>
+
+#include "Auditor.hpp"
+#include "Exchange.hpp"
+#include "Models.hpp"
+
+constexpr uint32_t NUM_ASSETS = ASSET_VALUES.size();
+
+const std::vector<uint32_t> STARTING_CASH = {30000, 30000, 30000, 27400};
+// const uint32_t STARTING_CASH = 10000;
+const std::vector<std::vector<uint32_t>> STARTING_ASSETS = {
+    {1000, 101, 66, 50}, // 16000
+    {200, 501, 66, 50},  // 16000
+    {201, 100, 333, 50},
+    {200, 101, 66, 250},
+};
+
+// One independent game, its ledger and the four exchanges trading against it.
+// Nothing here is shared between games.
+struct Game {
+  uint32_t id;
+  Ledger ledger;
+  std::vector<Exchange> exchanges;
+  std::atomic<bool> accepting{false};
+  AuditStats audit_stats;
+
+  std::mutex users_mutex;
+  std::unordered_map<uint32_t, uint8_t> assignments;
+  std::unordered_map<uint32_t, std::string> usernames;
+  uint8_t next_assignment{DRESSING};
+
+  // Books are backed by huge page arenas sized for huge_page_orders resting
+  // orders each when it's set
+  explicit Game(uint32_t id, size_t huge_page_orders = 0) : id(id) {
+    exchanges.reserve(NUM_ASSETS);
+    for (uint8_t i = 0; i < NUM_ASSETS; ++i) {
+      std::unique_ptr<HugePageArena> arena;
+      if (huge_page_orders > 0) {
+        arena = std::make_unique<HugePageArena>(
+            Exchange::arena_bytes(huge_page_orders));
+      }
+      exchanges.emplace_back(static_cast<Asset>(i), ledger, std::move(arena));
+    }
+  }
+
+  // Sizes every table for `users` players and each book for `orders` resting
+  // orders before the game opens, so the opening rush doesn't rehash
+  auto prefault(size_t users, size_t orders) -> void {
+    {
+      std::scoped_lock lock(users_mutex);
+      assignments.reserve(users);
+      usernames.reserve(users);
+    }
+    {
+      std::scoped_lock lock(ledger.cash_mutex);
+      ledger.user_cash.reserve(users);
+    }
+    for (auto &exchange : exchanges) {
+      exchange.prefault(users, orders);
+    }
+  }
+
+  auto register_user(Asset asset, uint32_t user_id, std::string_view username)
+      -> void {
+    uint8_t assignment = 0;
+    {
+      std::scoped_lock lock(users_mutex);
+      if (!assignments.contains(user_id)) {
+        assignments[user_id] = next_assignment;
+        next_assignment = static_cast<uint8_t>((next_assignment + 1) % 4);
+      }
+      assignment = assignments[user_id];
+      usernames[user_id] = username;
+    }
+    exchanges[asset].register_user(user_id, STARTING_CASH[assignment],
+                                   STARTING_ASSETS[assignment][asset]);
+  }
+
+  // Goes up whenever the user's cash, assets or orders change on any book,
+  // empty until they've registered on every book
+  auto state_version(uint32_t user_id) -> std::optional<uint64_t> {
+    for (auto &exchange : exchanges) {
+      std::scoped_lock lock(exchange.book_mutex());
+      if (!exchange.user_assets.contains(user_id)) {
+        return {};
+      }
+    }
+    std::scoped_lock lock(ledger.cash_mutex);
+    return ledger.state_versions.at(user_id);
+  }
+
+  auto get_portfolio_value(uint32_t user_id) -> uint32_t {
+    std::optional<uint32_t> cash;
+    {
+      std::scoped_lock lock(ledger.cash_mutex);
+      if (ledger.user_cash.contains(user_id)) {
+        cash = ledger.user_cash.at(user_id).amount_held;
+      }
+    }
+    if (!cash.has_value()) {
+      return 0;
+    }
+    uint32_t portfolio_value = cash.value();
+    std::optional<uint32_t> ruebens = {};
+    for (const auto &exchange : exchanges) {
+      if (exchange.user_assets.contains(user_id)) {
+        portfolio_value += exchange.user_assets.at(user_id).amount_held *
+                           value(exchange.asset);
+        if (ruebens.has_value()) {
+          ruebens = std::min(ruebens.value(),
+                             exchange.user_assets.at(user_id).amount_held);
+        } else {
+          ruebens = exchange.user_assets.at(user_id).amount_held;
+        }
+      }
+    }
+
+    if (ruebens.has_value()) {
+      portfolio_value += ruebens.value() * RUEBEN_VALUE;
+    }
+
+    return portfolio_value;
+  }
+
+  // (portfolio value, username) pairs, best first
+  auto leaderboard() -> std::vector<std::pair<uint32_t, std::string>> {
+    std::vector<std::pair<uint32_t, std::string>> users;
+    {
+      std::scoped_lock lock(users_mutex);
+      users.reserve(usernames.size());
+      for (const auto &[user_id, username] : usernames) {
+        users.emplace_back(user_id, username);
+      }
+    }
+    for (auto &[value, _] : users) {
+      value = get_portfolio_value(value);
+    }
+    std::ranges::sort(users, std::greater<>{});
+    return users;
+  }
+};
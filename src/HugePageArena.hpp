@@ -0,0 +1,78 @@
+#pragma once
+
+#include <cstddef>
+#include <cstdint>
+#include <memory_resource>
+
+#include <sys/mman.h>
+
+// Upstream for a book's node pool when a game is planned for huge pages. One
+// mapping sized from the plan, advised onto transparent huge pages so a full
+// book costs a handful of TLB entries instead of thousands, and touched up
+// front so the first orders don't fault. Memory is handed out in order and
+// only returned when the arena goes, the pool above keeps freed nodes on its
+// own free lists. Anything past the plan comes from the heap.
+struct HugePageArena : std::pmr::memory_resource {
+  static constexpr size_t HUGE_PAGE = 2 << 20;
+  static constexpr size_t PAGE = 4096;
+
+  void* mapping{nullptr};
+  size_t mapping_size{0};
+  std::byte* base{nullptr};
+  size_t capacity{0};
+  size_t used{0};
+  // Whether the kernel took the advice, e.g. not when THP is "never"
+  bool huge{false};
+  std::pmr::memory_resource* fallback{std::pmr::new_delete_resource()};
+
+  explicit HugePageArena(size_t bytes) {
+    capacity = (bytes + HUGE_PAGE - 1) / HUGE_PAGE * HUGE_PAGE;
+    // Over-map so the arena can start on a huge page boundary
+    mapping_size = capacity + HUGE_PAGE;
+    mapping = mmap(nullptr, mapping_size, PROT_READ | PROT_WRITE,
+                   MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if (mapping == MAP_FAILED) {
+      mapping = nullptr;
+      capacity = 0;
+      return;
+    }
+    auto start = reinterpret_cast<uintptr_t>(mapping);
+    base = reinterpret_cast<std::byte*>((start + HUGE_PAGE - 1) &
+                                        ~uintptr_t{HUGE_PAGE - 1});
+    huge = madvise(base, capacity, MADV_HUGEPAGE) == 0;
+    for (size_t offset = 0; offset < capacity; offset += PAGE) {
+      base[offset] = std::byte{0};
+    }
+  }
+
+  HugePageArena(const HugePageArena&) = delete;
+  auto operator=(const HugePageArena&) -> HugePageArena& = delete;
+
+  ~HugePageArena() override {
+    if (mapping != nullptr) {
+      munmap(mapping, mapping_size);
+    }
+  }
+
+ private:
+  auto do_allocate(size_t bytes, size_t alignment) -> void* override {
+    size_t start = (used + alignment - 1) & ~(alignment - 1);
+    if (base == nullptr || start + bytes > capacity) {
+      return fallback->allocate(bytes, alignment);
+    }
+    used = start + bytes;
+    return base + start;
+  }
+
+  auto do_deallocate(void* p, size_t bytes, size_t alignment) -> void override {
+    auto* byte = static_cast<std::byte*>(p);
+    if (base == nullptr || byte < base || byte >= base + capacity) {
+      fallback->deallocate(p, bytes, alignment);
+    }
+  }
+
+  [[nodiscard]] auto do_is_equal(const std::pmr::memory_resource& other) const
+      noexcept -> bool override {
+    return this == &other;
+  }
+};
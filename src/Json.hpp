@@ -0,0 +1,29 @@
+#pragma once
+
+#include <string>
+#include <string_view>
+
+#include <glaze/glaze.hpp>
+
+#include "Models.hpp"
+
+// See
+// https://github.com/stephenberry/glaze?tab=readme-ov-file#explicit-metadata
+template <> struct glz::meta<Order> {
+  using T = Order;
+  // NOLINTNEXTLINE(readability-identifier-naming)
+  static constexpr auto value = object(&T::asset, &T::side, &T::user_id,
+                                       &T::price, &T::volume, &T::order_id);
+};
+
+constexpr std::string_view ENCODING_ERROR_PAYLOAD = "Error encoding JSON.";
+
+// Serializes into a per-thread buffer that keeps its capacity between calls,
+// the returned view is only valid until the next call on the same thread
+template <typename T> auto to_json(const T &value) -> std::string_view {
+  thread_local std::string buffer;
+  if (glz::write_json(value, buffer)) {
+    return ENCODING_ERROR_PAYLOAD;
+  }
+  return buffer;
+}
@@ -0,0 +1,80 @@
+#pragma once
+
+#include <algorithm>
+#include <chrono>
+#include <cstddef>
+#include <cstdint>
+#include <vector>
+
+#include "Models.hpp"
+
+// Bars and running totals for one book, updated as each fill happens so
+// clients can load a chart without replaying every trade. Guarded by the
+// owning exchange's book lock.
+struct MarketStats {
+  int64_t interval_ms;
+  // Bars kept, reserve is free to round the capacity up
+  size_t history_length;
+  // Ring of the most recent bars, the oldest at candles[first] once full
+  std::vector<Candle> candles;
+  size_t first{0};
+  Ticker ticker{};
+
+  explicit MarketStats(int64_t interval_ms = 5000, size_t history = 720)
+      : interval_ms(std::max<int64_t>(interval_ms, 1)),
+        history_length(std::max<size_t>(history, 1)) {
+    candles.reserve(history_length);
+  }
+
+  static auto now_ms() -> int64_t {
+    return std::chrono::duration_cast<std::chrono::milliseconds>(
+               std::chrono::system_clock::now().time_since_epoch())
+        .count();
+  }
+
+  auto on_trade(uint32_t price, uint32_t volume, int64_t time_ms) -> void {
+    ticker.last = price;
+    ticker.volume += volume;
+    ticker.notional += uint64_t{price} * volume;
+    ++ticker.trades;
+
+    int64_t start_ms = time_ms - time_ms % interval_ms;
+    if (candles.empty() || latest().start_ms != start_ms) {
+      Candle candle{.start_ms = start_ms,
+                    .open = price,
+                    .high = price,
+                    .low = price,
+                    .close = price,
+                    .volume = 0,
+                    .notional = 0,
+                    .vwap = 0};
+      if (candles.size() < history_length) {
+        candles.push_back(candle);
+      } else {
+        candles[first] = candle;
+        first = (first + 1) % candles.size();
+      }
+    }
+    Candle& candle = latest();
+    candle.high = std::max(candle.high, price);
+    candle.low = std::min(candle.low, price);
+    candle.close = price;
+    candle.volume += volume;
+    candle.notional += uint64_t{price} * volume;
+    candle.vwap = static_cast<double>(candle.notional) /
+                  static_cast<double>(candle.volume);
+  }
+
+  [[nodiscard]] auto latest() -> Candle& {
+    return candles[(first + candles.size() - 1) % candles.size()];
+  }
+
+  [[nodiscard]] auto history() const -> std::vector<Candle> {
+    std::vector<Candle> ordered;
+    ordered.reserve(candles.size());
+    for (size_t i = 0; i < candles.size(); ++i) {
+      ordered.push_back(candles[(first + i) % candles.size()]);
+    }
+    return ordered;
+  }
+};
@@ -1,7 +1,11 @@
 #pragma once
 
+#include <algorithm>
+#include <array>
+#include <chrono>
 #include <cstdint>
 #include <optional>
+#include <span>
 #include <string>
 #include <string_view>
 #include <unordered_map>
@@ -52,6 +56,15 @@ auto constexpr to_string_lower(Asset asset) -> std::string {
   }
 }
 
+auto inline parse_asset(std::string_view name) -> std::optional<Asset> {
+  for (uint8_t i = 0; i < ASSET_VALUES.size(); ++i) {
+    if (name == to_string_lower(static_cast<Asset>(i))) {
+      return static_cast<Asset>(i);
+    }
+  }
+  return {};
+}
+
 auto constexpr value(Asset asset) -> uint32_t {
   return ASSET_VALUES[static_cast<size_t>(asset)];
 }
@@ -79,6 +92,8 @@ struct Order {
   uint32_t volume;
   uint32_t order_id;
 
+  // For reading orders back out of JSON
+  Order() = default;
   Order(Asset asset, Side side, uint32_t user_id, uint32_t price,
         uint32_t volume, uint32_t order_id)
       : asset(asset),
@@ -99,17 +114,119 @@ struct AssetAmount {
   uint32_t selling_power;
 };
 
+// Held back by one user's resting orders on one book, buys reserve cash and
+// sells reserve the asset
+struct Reservation {
+  uint64_t cash{0};
+  uint32_t assets{0};
+};
+
+// error points at a static string, trades at the exchange's trades_buffer,
+// both only valid until the next order on that exchange
 struct OrderResult {
-  std::optional<std::string> error;
-  std::optional<std::vector<Trade>> trades;
+  std::optional<std::string_view> error;
+  std::span<const Trade> trades;
   std::optional<Order> unmatched_order;
 };
 
+// One leg of a basket order. Basket legs never rest on the book, each leg
+// must fill completely against resting orders or the whole basket is rejected.
+struct BasketLeg {
+  Asset asset;
+  Side side;
+  uint32_t price;
+  uint32_t volume;
+};
+
+struct BasketResult {
+  std::optional<std::string> error;
+  // trades[i] holds the fills for legs[i]
+  std::vector<std::vector<Trade>> trades;
+};
+
+// One bar of trading, vwap is notional / volume
+struct Candle {
+  int64_t start_ms;
+  uint32_t open;
+  uint32_t high;
+  uint32_t low;
+  uint32_t close;
+  uint64_t volume;
+  uint64_t notional;
+  double vwap;
+};
+
+// Totals are since the game started
+struct Ticker {
+  std::optional<uint32_t> last;
+  std::optional<uint32_t> best_bid;
+  std::optional<uint32_t> best_ask;
+  uint64_t volume{0};
+  uint64_t notional{0};
+  uint64_t trades{0};
+
+  auto operator==(const Ticker&) const -> bool = default;
+};
+
+struct MarketSummary {
+  Ticker ticker;
+  // Oldest first, intervals without trades are skipped
+  std::vector<Candle> candles;
+};
+
 // API/Websocket message types
 
+// CLOCK_MONOTONIC on Linux, what every server timestamp is measured on
+inline auto monotonic_ns() -> int64_t {
+  return std::chrono::duration_cast<std::chrono::nanoseconds>(
+             std::chrono::steady_clock::now().time_since_epoch())
+      .count();
+}
+
+// When the server handled a message, so clients can split their latency into
+// network and exchange time. published_ns is taken just before serializing.
+struct ServerTimes {
+  int64_t received_ns;
+  int64_t matched_ns;
+  int64_t published_ns;
+};
+
+// One user's balances on one book, pushed to their own socket there whenever
+// they change. version orders it against other pushes and get_state.
+struct Position {
+  uint64_t version;
+  Asset asset;
+  uint32_t cash;
+  uint32_t buying_power;
+  uint32_t assets_held;
+  uint32_t selling_power;
+};
+
+struct TokenBucket {
+  double tokens{0};
+  std::chrono::steady_clock::time_point last_refill{};
+
+  auto try_consume(double rate, double burst,
+                   std::chrono::steady_clock::time_point now) -> bool {
+    double elapsed = std::chrono::duration<double>(now - last_refill).count();
+    tokens = std::min(burst, tokens + rate * elapsed);
+    last_refill = now;
+    if (tokens < 1) {
+      return false;
+    }
+    tokens -= 1;
+    return true;
+  }
+};
+
 struct SocketData {
   uint32_t user_id{0};
   bool registered{false};
+  TokenBucket rate_limit{};
+  // Unsubscribed for falling behind, waiting to drain before a snapshot
+  bool lagging{false};
+  // Connected on a /deflate path
+  bool deflate{false};
 };
 
 enum MessageType : uint8_t {
@@ -117,6 +234,12 @@ enum MessageType : uint8_t {
   ORDER = 1,
   CANCEL = 2,
   ERROR = 3,
+  BASKET = 4,
+  SNAPSHOT = 5,
+  RESUME = 6,
+  TICKER = 7,
+  PING = 8,
+  POSITION = 9,
 };
 
 struct IncomingMessage {
@@ -131,23 +254,48 @@ struct IncomingMessage {
   std::optional<uint32_t> volume;
   // cancel
   std::optional<uint32_t> order_id;
+  // basket
+  std::optional<std::vector<BasketLeg>> legs;
+  // resume, the last seq the client saw
+  std::optional<uint64_t> seq;
+  // ping, echoed back untouched
+  std::optional<double> client_time;
 };
 
+// Borrows everything it can from the engine result it describes, so it must
+// be serialized before the next order on that exchange
 struct OutgoingMessage {
   std::optional<MessageType> type;
-  std::optional<std::string> error;
+  std::optional<std::string_view> error;
+  // set on everything published, and on snapshots
+  std::optional<uint64_t> seq;
   // register
   std::optional<uint32_t> user_id;
   std::optional<std::string_view> username;
   // order
-  std::optional<std::vector<Trade>> trades;
+  std::optional<std::span<const Trade>> trades;
   std::optional<Order> unmatched_order;
   // cancel
   std::optional<uint32_t> order_id;
+  // basket
+  std::optional<std::vector<std::vector<Trade>>> basket_trades;
+  // snapshot
+  std::optional<std::vector<Order>> orders;
+  // ticker
+  std::optional<Ticker> ticker;
+  // order, cancel and basket
+  std::optional<ServerTimes> times;
+  // ping
+  std::optional<double> client_time;
+  std::optional<int64_t> server_ns;
+  // position
+  std::optional<Position> position;
 };
 
 struct GameState {
   std::optional<std::string> error;
+  uint64_t version{0};
+  // The user's own resting orders, books come from each asset's snapshot
   std::unordered_map<uint32_t, Order> orders;
   uint32_t cash{0};
   uint32_t buying_power{0};
@@ -0,0 +1,173 @@
+#pragma once
+
+#include <algorithm>
+#include <array>
+#include <cstddef>
+#include <cstdint>
+#include <list>
+#include <map>
+#include <memory_resource>
+#include <optional>
+#include <type_traits>
+#include <utility>
+
+#include "Models.hpp"
+
+// One side of a book. Levels are keyed by rank, their distance from the best
+// possible price on that side, so both sides are visited best price first
+// without caring which way prices run.
+
+using PriceLevel = std::pmr::list<Order>;
+
+// Every level allocated up front, indexing is a subtraction. The best rank is
+// tracked as orders come and go, so finding it never scans the empty levels.
+template <uint32_t Min, uint32_t Max>
+struct DenseGrid {
+  static_assert(Min <= Max);
+  static constexpr uint32_t MIN = Min;
+  static constexpr uint32_t MAX = Max;
+  static constexpr size_t SIZE = size_t{Max - Min} + 1;
+
+  using Levels = std::array<PriceLevel, SIZE>;
+
+  Side side;
+  Levels levels;
+  // Every level ranked before this is empty, SIZE when the whole side is
+  size_t best_rank{SIZE};
+
+  DenseGrid(Side side, std::pmr::memory_resource* resource)
+      : side(side), levels(make_levels(resource)) {}
+
+  static auto make_levels(std::pmr::memory_resource* resource) -> Levels {
+    return [resource]<size_t... I>(std::index_sequence<I...>) {
+      return Levels{((void)I, PriceLevel(resource))...};
+    }(std::make_index_sequence<SIZE>{});
+  }
+
+  [[nodiscard]] auto rank(uint32_t price) const -> size_t {
+    return side == BUY ? Max - price : price - Min;
+  }
+
+  // The caller adds an order to the level it gets
+  auto level(uint32_t price) -> PriceLevel& {
+    size_t r = rank(price);
+    best_rank = std::min(best_rank, r);
+    return levels[r];
+  }
+
+  auto remove(PriceLevel::iterator order) -> void {
+    size_t r = rank(order->price);
+    levels[r].erase(order);
+    if (r == best_rank) {
+      skip_empty();
+    }
+  }
+
+  auto skip_empty() -> void {
+    while (best_rank < SIZE && levels[best_rank].empty()) {
+      ++best_rank;
+    }
+  }
+
+  // Calls visit(price, level) on each non-empty level until it returns false
+  template <typename Visit>
+  auto drain(Visit&& visit) -> void {
+    for (size_t r = best_rank; r < SIZE; ++r) {
+      PriceLevel& level = levels[r];
+      if (!level.empty() && !visit(level.front().price, level)) {
+        break;
+      }
+    }
+    skip_empty();
+  }
+
+  template <typename Visit>
+  auto for_each(Visit&& visit) const -> void {
+    for (size_t r = best_rank; r < SIZE; ++r) {
+      const PriceLevel& level = levels[r];
+      if (!level.empty() && !visit(level.front().price, level)) {
+        return;
+      }
+    }
+  }
+
+  [[nodiscard]] auto best() const -> std::optional<uint32_t> {
+    for (size_t r = best_rank; r < SIZE; ++r) {
+      if (!levels[r].empty()) {
+        return levels[r].front().price;
+      }
+    }
+    return {};
+  }
+};
+
+// Only levels with resting orders exist, so a range of millions of ticks
+// costs nothing until it's traded on. Nodes come from the book's pool like
+// the orders do, and the best level is always the first node.
+template <uint32_t Min, uint32_t Max>
+struct SparseGrid {
+  static_assert(Min <= Max);
+  static constexpr uint32_t MIN = Min;
+  static constexpr uint32_t MAX = Max;
+
+  Side side;
+  std::pmr::map<uint32_t, PriceLevel> levels;
+
+  SparseGrid(Side side, std::pmr::memory_resource* resource)
+      : side(side), levels(resource) {}
+
+  [[nodiscard]] auto rank(uint32_t price) const -> uint32_t {
+    return side == BUY ? Max - price : price - Min;
+  }
+
+  auto level(uint32_t price) -> PriceLevel& {
+    return levels.try_emplace(rank(price)).first->second;
+  }
+
+  // Drops the level once its last order goes, so visiting stays
+  // proportional to the levels in use
+  auto remove(PriceLevel::iterator order) -> void {
+    auto node = levels.find(rank(order->price));
+    node->second.erase(order);
+    if (node->second.empty()) {
+      levels.erase(node);
+    }
+  }
+
+  template <typename Visit>
+  auto drain(Visit&& visit) -> void {
+    for (auto node = levels.begin(); node != levels.end();) {
+      PriceLevel& level = node->second;
+      bool more = level.empty() || visit(level.front().price, level);
+      node = level.empty() ? levels.erase(node) : std::next(node);
+      if (!more) {
+        return;
+      }
+    }
+  }
+
+  template <typename Visit>
+  auto for_each(Visit&& visit) const -> void {
+    for (const auto& [_, level] : levels) {
+      if (!level.empty() && !visit(level.front().price, level)) {
+        return;
+      }
+    }
+  }
+
+  [[nodiscard]] auto best() const -> std::optional<uint32_t> {
+    for (const auto& [_, level] : levels) {
+      if (!level.empty()) {
+        return level.front().price;
+      }
+    }
+    return {};
+  }
+};
+
+// Ranges up to this many ticks get a dense grid
+static constexpr uint32_t DENSE_GRID_LIMIT = 4096;
+
+template <uint32_t Min, uint32_t Max>
+using PriceGrid = std::conditional_t<(Max - Min < DENSE_GRID_LIMIT),
+                                     DenseGrid<Min, Max>, SparseGrid<Min, Max>>;
@@ -0,0 +1,192 @@
+#pragma once
+
+#include <algorithm>
+#include <array>
+#include <cstddef>
+#include <cstdint>
+#include <map>
+#include <optional>
+#include <string>
+#include <vector>
+
+#include "Models.hpp"
+
+// A deliberately naive model of a game's four books and shared cash, for
+// fuzz.cpp to check Exchange against. Books are vectors in arrival order
+// that are scanned in full for every fill, and balances are 64 bit so
+// nothing can wrap. Keep it obviously right rather than fast.
+
+struct ReferenceBalances {
+  int64_t cash_held;
+  int64_t buying_power;
+  std::array<int64_t, ASSET_VALUES.size()> assets_held;
+  std::array<int64_t, ASSET_VALUES.size()> selling_power;
+};
+
+struct ReferenceResult {
+  std::optional<std::string> error;
+  std::vector<Trade> trades;
+  std::optional<Order> resting;
+};
+
+struct ReferenceExchange {
+  std::map<uint32_t, ReferenceBalances> users;
+  std::array<std::vector<Order>, ASSET_VALUES.size()> books;
+  // Shared by every book, only taken by orders that rest
+  uint32_t next_order_id{0};
+  // The engine's configured range by default, books built on a wider grid
+  // set their own
+  uint32_t min_price{MIN_PRICE};
+  uint32_t max_price{MAX_PRICE};
+
+  auto add_user(uint32_t user_id, uint32_t cash,
+                const std::array<uint32_t, ASSET_VALUES.size()>& assets)
+      -> void {
+    ReferenceBalances& balances = users[user_id];
+    balances.cash_held = cash;
+    balances.buying_power = cash;
+    for (size_t i = 0; i < assets.size(); ++i) {
+      balances.assets_held[i] = assets[i];
+      balances.selling_power[i] = assets[i];
+    }
+  }
+
+  // Checked in the same order as the engine so the first problem wins
+  auto reject_reason(Asset asset, Side side, uint32_t user_id, uint32_t price,
+                     uint32_t volume) const -> std::optional<std::string> {
+    auto user = users.find(user_id);
+    if (user == users.end()) {
+      return "User not found.";
+    }
+    // Two 32 bit factors always fit in 64 unsigned bits
+    if (side == BUY && uint64_t{price} * volume >
+                           static_cast<uint64_t>(user->second.buying_power)) {
+      return "Insufficient buying power for order.";
+    }
+    if (side == SELL &&
+        int64_t{volume} > user->second.selling_power[asset]) {
+      return "Insufficient asset " + to_string(asset) + " for order.";
+    }
+    if (price < min_price || price > max_price) {
+      return "Price must be in range [" + std::to_string(min_price) + ", " +
+             std::to_string(max_price) + "] inclusive";
+    }
+    if (volume == 0) {
+      return "Volume must be positive";
+    }
+    return {};
+  }
+
+  // Best price on the opposing side, earliest arrival among equals
+  auto best_maker(Asset asset, Side side, uint32_t price)
+      -> std::vector<Order>::iterator {
+    std::vector<Order>& book = books[asset];
+    auto best = book.end();
+    for (auto it = book.begin(); it != book.end(); ++it) {
+      if (it->side == side) {
+        continue;
+      }
+      bool crosses = side == BUY ? it->price <= price : it->price >= price;
+      bool better = best == book.end() ||
+                    (side == BUY ? it->price < best->price
+                                 : it->price > best->price);
+      if (crosses && better) {
+        best = it;
+      }
+    }
+    return best;
+  }
+
+  auto place_order(Asset asset, Side side, uint32_t user_id, uint32_t price,
+                   uint32_t volume) -> ReferenceResult {
+    ReferenceResult result;
+    result.error = reject_reason(asset, side, user_id, price, volume);
+    if (result.error.has_value()) {
+      return result;
+    }
+
+    while (volume > 0) {
+      auto maker = best_maker(asset, side, price);
+      if (maker == books[asset].end()) {
+        break;
+      }
+      uint32_t fill = std::min(volume, maker->volume);
+      int64_t cost = int64_t{maker->price} * fill;
+      ReferenceBalances& buyer =
+          users[side == BUY ? user_id : maker->user_id];
+      ReferenceBalances& seller =
+          users[side == BUY ? maker->user_id : user_id];
+      // A resting buy already set aside its cost, a resting sell its assets
+      buyer.cash_held -= cost;
+      buyer.assets_held[asset] += fill;
+      buyer.selling_power[asset] += fill;
+      seller.cash_held += cost;
+      seller.buying_power += cost;
+      seller.assets_held[asset] -= fill;
+      if (side == BUY) {
+        buyer.buying_power -= cost;
+      } else {
+        seller.selling_power[asset] -= fill;
+      }
+      result.trades.push_back({.buyer_id = side == BUY ? user_id
+                                                       : maker->user_id,
+                               .seller_id = side == BUY ? maker->user_id
+                                                        : user_id,
+                               .price = maker->price,
+                               .volume = fill,
+                               .order_id = maker->order_id});
+      volume -= fill;
+      maker->volume -= fill;
+      if (maker->volume == 0) {
+        books[asset].erase(maker);
+      }
+    }
+
+    if (volume > 0) {
+      ReferenceBalances& user = users[user_id];
+      if (side == BUY) {
+        user.buying_power -= int64_t{price} * volume;
+      } else {
+        user.selling_power[asset] -= volume;
+      }
+      result.resting = books[asset].emplace_back(asset, side, user_id, price,
+                                                 volume, next_order_id++);
+    }
+    return result;
+  }
+
+  auto cancel_order(Asset asset, uint32_t order_id)
+      -> std::optional<std::string> {
+    std::vector<Order>& book = books[asset];
+    auto order = std::ranges::find_if(
+        book, [order_id](const Order& o) { return o.order_id == order_id; });
+    if (order == book.end()) {
+      return "Order not found.";
+    }
+    ReferenceBalances& user = users[order->user_id];
+    if (order->side == BUY) {
+      user.buying_power += int64_t{order->price} * order->volume;
+    } else {
+      user.selling_power[asset] += order->volume;
+    }
+    book.erase(order);
+    return {};
+  }
+
+  // Bids best first then asks best first, arrival order within a price
+  [[nodiscard]] auto snapshot(Asset asset) const -> std::vector<Order> {
+    std::vector<Order> bids;
+    std::vector<Order> asks;
+    for (const Order& order : books[asset]) {
+      (order.side == BUY ? bids : asks).push_back(order);
+    }
+    std::ranges::stable_sort(bids, [](const Order& a, const Order& b) {
+      return a.price > b.price;
+    });
+    std::ranges::stable_sort(asks, [](const Order& a, const Order& b) {
+      return a.price < b.price;
+    });
+    bids.insert(bids.end(), asks.begin(), asks.end());
+    return bids;
+  }
+};
@@ -0,0 +1,292 @@
+#pragma once
+
+#include <algorithm>
+#include <atomic>
+#include <bit>
+#include <chrono>
+#include <cstddef>
+#include <cstdint>
+#include <cstdio>
+#include <fcntl.h>
+#include <memory>
+#include <string>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include "Models.hpp"
+
+// Binary market data for processes on the same box. Each exchange owns one
+// ring in shared memory, written by whichever thread holds that exchange's
+// book lock, and read lock-free by any number of local processes.
+
+enum FeedEventType : uint8_t {
+  FEED_ORDER = 0,
+  FEED_TRADE = 1,
+  FEED_CANCEL = 2,
+  // An incoming order that traded away entirely, ends its run of trades the
+  // way FEED_ORDER does for one that rests
+  FEED_FILLED = 3,
+};
+
+struct FeedEvent {
+  uint64_t seq;
+  // steady_clock nanoseconds when the event was written
+  uint64_t timestamp_ns;
+  FeedEventType type;
+  Asset asset;
+  Side side;  // unused for trades
+  uint8_t padding{0};
+  uint32_t order_id;  // the maker's order for trades
+  uint32_t user_id;   // the buyer for trades
+  uint32_t seller_id; // trades only
+  uint32_t price;
+  uint32_t volume;
+};
+
+static constexpr uint32_t FEED_MAGIC = 0x5a494e47; // "ZING"
+static constexpr uint32_t FEED_VERSION = 2;
+
+struct alignas(64) FeedSlot {
+  // seq of the event in the slot, 0 while it's being overwritten
+  std::atomic<uint64_t> seq;
+  FeedEvent event;
+};
+
+struct FeedHeader {
+  uint32_t magic;
+  uint32_t version;
+  uint64_t capacity;
+  alignas(64) std::atomic<uint64_t> write_seq;
+};
+
+static_assert(std::atomic<uint64_t>::is_always_lock_free);
+
+auto inline feed_name(uint32_t game_id, Asset asset) -> std::string {
+  return "/zingers-" + std::to_string(game_id) + "-" + to_string_lower(asset);
+}
+
+auto inline feed_size(uint64_t capacity) -> size_t {
+  return sizeof(FeedHeader) + capacity * sizeof(FeedSlot);
+}
+
+struct ShmFeedWriter {
+  std::string name;
+  Asset asset;
+  size_t size;
+  FeedHeader* header;
+  FeedSlot* slots;
+  uint64_t mask;
+
+  ShmFeedWriter(std::string name, Asset asset, size_t size, FeedHeader* header)
+      : name(std::move(name)),
+        asset(asset),
+        size(size),
+        header(header),
+        slots(reinterpret_cast<FeedSlot*>(header + 1)),
+        mask(header->capacity - 1) {}
+
+  ShmFeedWriter(const ShmFeedWriter&) = delete;
+  auto operator=(const ShmFeedWriter&) -> ShmFeedWriter& = delete;
+
+  ~ShmFeedWriter() {
+    munmap(header, size);
+    shm_unlink(name.c_str());
+  }
+
+  // capacity is rounded up to a power of two, returns nullptr on failure
+  static auto create(uint32_t game_id, Asset asset, uint64_t capacity)
+      -> std::unique_ptr<ShmFeedWriter> {
+    capacity = std::bit_ceil(std::max<uint64_t>(capacity, 2));
+    std::string name = feed_name(game_id, asset);
+    size_t size = feed_size(capacity);
+    int fd = shm_open(name.c_str(), O_CREAT | O_RDWR | O_TRUNC, 0644);
+    if (fd == -1) {
+      perror("shm_open");
+      return nullptr;
+    }
+    if (ftruncate(fd, static_cast<off_t>(size)) == -1) {
+      perror("ftruncate");
+      close(fd);
+      return nullptr;
+    }
+    void* mem = mmap(nullptr, size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+    close(fd);
+    if (mem == MAP_FAILED) {
+      perror("mmap");
+      return nullptr;
+    }
+    // ftruncate zero fills, so every slot starts out empty
+    auto* header = static_cast<FeedHeader*>(mem);
+    header->capacity = capacity;
+    header->write_seq.store(0, std::memory_order_relaxed);
+    header->version = FEED_VERSION;
+    std::atomic_thread_fence(std::memory_order_release);
+    header->magic = FEED_MAGIC;
+    return std::make_unique<ShmFeedWriter>(std::move(name), asset, size,
+                                           header);
+  }
+
+  auto write(FeedEvent event) -> void {
+    uint64_t seq = header->write_seq.load(std::memory_order_relaxed) + 1;
+    event.seq = seq;
+    event.timestamp_ns = static_cast<uint64_t>(
+        std::chrono::duration_cast<std::chrono::nanoseconds>(
+            std::chrono::steady_clock::now().time_since_epoch())
+            .count());
+    FeedSlot& slot = slots[seq & mask];
+    slot.seq.store(0, std::memory_order_relaxed);
+    std::atomic_thread_fence(std::memory_order_release);
+    slot.event = event;
+    slot.seq.store(seq, std::memory_order_release);
+    header->write_seq.store(seq, std::memory_order_release);
+  }
+
+  auto on_order(const Order& order) -> void {
+    write({.seq = 0,
+           .timestamp_ns = 0,
+           .type = FEED_ORDER,
+           .asset = asset,
+           .side = order.side,
+           .order_id = order.order_id,
+           .user_id = order.user_id,
+           .seller_id = 0,
+           .price = order.price,
+           .volume = order.volume});
+  }
+
+  auto on_trade(const Trade& trade) -> void {
+    write({.seq = 0,
+           .timestamp_ns = 0,
+           .type = FEED_TRADE,
+           .asset = asset,
+           .side = BUY,
+           .order_id = trade.order_id,
+           .user_id = trade.buyer_id,
+           .seller_id = trade.seller_id,
+           .price = trade.price,
+           .volume = trade.volume});
+  }
+
+  auto on_filled(Side side, uint32_t user_id, uint32_t price) -> void {
+    write({.seq = 0,
+           .timestamp_ns = 0,
+           .type = FEED_FILLED,
+           .asset = asset,
+           .side = side,
+           .order_id = 0,
+           .user_id = user_id,
+           .seller_id = 0,
+           .price = price,
+           .volume = 0});
+  }
+
+  auto on_cancel(const Order& order) -> void {
+    write({.seq = 0,
+           .timestamp_ns = 0,
+           .type = FEED_CANCEL,
+           .asset = asset,
+           .side = order.side,
+           .order_id = order.order_id,
+           .user_id = order.user_id,
+           .seller_id = 0,
+           .price = order.price,
+           .volume = order.volume});
+  }
+};
+
+enum class FeedPoll : uint8_t {
+  EVENT,
+  // Nothing new yet, or the next slot is mid-write
+  EMPTY,
+  // The writer lapped us, `lost` events (at least one) were skipped
+  GAP,
+};
+
+struct ShmFeedReader {
+  size_t size;
+  const FeedHeader* header;
+  const FeedSlot* slots;
+  uint64_t mask;
+  uint64_t next_seq;
+  uint64_t lost{0};
+
+  ShmFeedReader(size_t size, const FeedHeader* header)
+      : size(size),
+        header(header),
+        slots(reinterpret_cast<const FeedSlot*>(header + 1)),
+        mask(header->capacity - 1),
+        // Start from the live edge rather than replaying the whole ring
+        next_seq(header->write_seq.load(std::memory_order_acquire) + 1) {}
+
+  ShmFeedReader(const ShmFeedReader&) = delete;
+  auto operator=(const ShmFeedReader&) -> ShmFeedReader& = delete;
+
+  ~ShmFeedReader() { munmap(const_cast<FeedHeader*>(header), size); }
+
+  static auto open(uint32_t game_id, Asset asset)
+      -> std::unique_ptr<ShmFeedReader> {
+    std::string name = feed_name(game_id, asset);
+    int fd = shm_open(name.c_str(), O_RDONLY, 0);
+    if (fd == -1) {
+      perror("shm_open");
+      return nullptr;
+    }
+    struct stat st{};
+    if (fstat(fd, &st) == -1 ||
+        static_cast<size_t>(st.st_size) < sizeof(FeedHeader)) {
+      fprintf(stderr, "%s is not a zingers feed\n", name.c_str());
+      close(fd);
+      return nullptr;
+    }
+    auto size = static_cast<size_t>(st.st_size);
+    void* mem = mmap(nullptr, size, PROT_READ, MAP_SHARED, fd, 0);
+    close(fd);
+    if (mem == MAP_FAILED) {
+      perror("mmap");
+      return nullptr;
+    }
+    const auto* header = static_cast<const FeedHeader*>(mem);
+    if (header->magic != FEED_MAGIC || header->version != FEED_VERSION ||
+        feed_size(header->capacity) != size) {
+      fprintf(stderr, "%s is not a zingers feed\n", name.c_str());
+      munmap(mem, size);
+      return nullptr;
+    }
+    return std::make_unique<ShmFeedReader>(size, header);
+  }
+
+  // Moves back to the oldest event still in the ring, returns whether that is
+  // the first event ever written
+  auto rewind() -> bool {
+    uint64_t write_seq = header->write_seq.load(std::memory_order_acquire);
+    next_seq = write_seq > mask ? write_seq - mask : 1;
+    return next_seq == 1;
+  }
+
+  auto poll(FeedEvent& out) -> FeedPoll {
+    const FeedSlot& slot = slots[next_seq & mask];
+    uint64_t before = slot.seq.load(std::memory_order_acquire);
+    if (before == next_seq) {
+      out = slot.event;
+      std::atomic_thread_fence(std::memory_order_acquire);
+      if (slot.seq.load(std::memory_order_relaxed) == next_seq) {
+        ++next_seq;
+        return FeedPoll::EVENT;
+      }
+    } else if (header->write_seq.load(std::memory_order_acquire) < next_seq) {
+      return FeedPoll::EMPTY;
+    }
+    // Either the slot was overwritten under us or already holds a later lap.
+    // The writer publishes write_seq after the slot, so a slot it's still
+    // writing can look lost while write_seq says nothing was, try again then.
+    uint64_t write_seq = header->write_seq.load(std::memory_order_acquire);
+    uint64_t oldest = write_seq > mask ? write_seq - mask : 1;
+    if (oldest <= next_seq) {
+      return FeedPoll::EMPTY;
+    }
+    lost = oldest - next_seq;
+    next_seq = oldest;
+    return FeedPoll::GAP;
+  }
+};
@@ -0,0 +1,122 @@
+#pragma once
+
+#include <algorithm>
+#include <cstddef>
+#include <cstdint>
+#include <filesystem>
+#include <fstream>
+#include <iterator>
+#include <string>
+#include <string_view>
+#include <unordered_map>
+#include <vector>
+
+#include "Deflate.hpp"
+
+// The frontend bundle, read and compressed once at startup so a page load is
+// a hash lookup and a write. Any file.br next to a file is served to clients
+// that accept brotli, build it with e.g. `brotli -k static/js/index.js`.
+// Only built assets are cached: files with a known type below, and of the
+// HTML only the pages asked for by name, since the web app keeps its
+// templates in the same directory.
+
+struct StaticFile {
+  std::string_view content_type;
+  // Quoted, the same for every encoding of the file
+  std::string etag;
+  std::string identity;
+  // Empty when compressing doesn't pay off
+  std::string gzip;
+  std::string brotli;
+};
+
+// Empty for anything that isn't served
+inline auto content_type_for(const std::filesystem::path& path)
+    -> std::string_view {
+  static const std::unordered_map<std::string, std::string_view> types = {
+      {".html", "text/html; charset=utf-8"},
+      {".css", "text/css; charset=utf-8"},
+      {".js", "text/javascript; charset=utf-8"},
+      {".map", "application/json"},
+      {".json", "application/json"},
+      {".svg", "image/svg+xml"},
+      {".png", "image/png"},
+      {".jpg", "image/jpeg"},
+      {".jpeg", "image/jpeg"},
+      {".ico", "image/x-icon"},
+      {".ttf", "font/ttf"},
+      {".woff2", "font/woff2"},
+  };
+  auto it = types.find(path.extension().string());
+  return it == types.end() ? std::string_view{} : it->second;
+}
+
+// FNV-1a, only has to tell versions of the same file apart
+inline auto content_etag(std::string_view content) -> std::string {
+  uint64_t hash = 14695981039346656037ULL;
+  for (char c : content) {
+    hash = (hash ^ static_cast<uint8_t>(c)) * 1099511628211ULL;
+  }
+  static constexpr std::string_view DIGITS = "0123456789abcdef";
+  std::string etag = "\"";
+  for (int shift = 60; shift >= 0; shift -= 4) {
+    etag += DIGITS[(hash >> shift) & 0xf];
+  }
+  return etag + '"';
+}
+
+inline auto read_file(const std::filesystem::path& path) -> std::string {
+  std::ifstream in(path, std::ios::binary);
+  return {std::istreambuf_iterator<char>(in), std::istreambuf_iterator<char>()};
+}
+
+struct StaticFiles {
+  // By URL path, e.g. /static/js/index.js
+  std::unordered_map<std::string, StaticFile> files;
+  size_t bytes{0};
+
+  // The assets under root and the named pages, relative to root, served
+  // below url_prefix
+  static auto load(const std::filesystem::path& root,
+                   const std::string& url_prefix,
+                   const std::vector<std::string>& pages) -> StaticFiles {
+    StaticFiles cache;
+    std::error_code ec;
+    for (const auto& entry :
+         std::filesystem::recursive_directory_iterator(root, ec)) {
+      const std::filesystem::path& path = entry.path();
+      std::string relative =
+          std::filesystem::relative(path, root).generic_string();
+      std::string_view content_type = content_type_for(path);
+      if (!entry.is_regular_file() || content_type.empty() ||
+          (path.extension() == ".html" &&
+           std::find(pages.begin(), pages.end(), relative) == pages.end())) {
+        continue;
+      }
+      StaticFile file{.content_type = content_type,
+                      .etag = {},
+                      .identity = read_file(path),
+                      .gzip = {},
+                      .brotli = {}};
+      file.etag = content_etag(file.identity);
+      std::string compressed = gzip(file.identity);
+      if (compressed.size() < file.identity.size() * 9 / 10) {
+        file.gzip = std::move(compressed);
+      }
+      std::filesystem::path brotli_path = path;
+      brotli_path += ".br";
+      if (std::filesystem::is_regular_file(brotli_path)) {
+        file.brotli = read_file(brotli_path);
+      }
+      cache.bytes +=
+          file.identity.size() + file.gzip.size() + file.brotli.size();
+      cache.files.emplace(url_prefix + "/" + relative, std::move(file));
+    }
+    return cache;
+  }
+
+  [[nodiscard]] auto find(std::string_view url) const -> const StaticFile* {
+    auto it = files.find(std::string(url));
+    return it == files.end() ? nullptr : &it->second;
+  }
+};
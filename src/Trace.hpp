@@ -0,0 +1,238 @@
+#pragma once
+
+#include <algorithm>
+#include <atomic>
+#include <bit>
+#include <chrono>
+#include <cstddef>
+#include <cstdint>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <vector>
+
+#if defined(__x86_64__) || defined(__i386__)
+#include <x86intrin.h>
+#endif
+
+// Sampled tracing of individual messages. One in every sample_every messages
+// is traced, each TraceSpan on that thread records into a per-thread ring
+// until the message is done, and everything else costs a thread_local check.
+
+inline auto tsc() -> uint64_t {
+#if defined(__x86_64__) || defined(__i386__)
+  return __rdtsc();
+#else
+  return static_cast<uint64_t>(
+      std::chrono::steady_clock::now().time_since_epoch().count());
+#endif
+}
+
+// Converts tsc() readings to microseconds since the clock was first used
+struct TscClock {
+  uint64_t base;
+  double ticks_per_us;
+
+  static auto get() -> const TscClock& {
+    static const TscClock clock = calibrate();
+    return clock;
+  }
+
+  static auto calibrate() -> TscClock {
+    auto wall_start = std::chrono::steady_clock::now();
+    uint64_t start = tsc();
+    std::this_thread::sleep_for(std::chrono::milliseconds(20));
+    uint64_t end = tsc();
+    std::chrono::duration<double, std::micro> elapsed =
+        std::chrono::steady_clock::now() - wall_start;
+    return {.base = start,
+            .ticks_per_us = static_cast<double>(end - start) / elapsed.count()};
+  }
+
+  [[nodiscard]] auto to_us(uint64_t ticks) const -> double {
+    return static_cast<double>(ticks - std::min(ticks, base)) / ticks_per_us;
+  }
+};
+
+struct TraceRecord {
+  // Always a string literal
+  const char* name;
+  uint64_t trace_id;
+  uint64_t start;
+  uint64_t end;
+};
+
+struct alignas(64) TraceSlot {
+  // Index of the record in the slot, 0 while it's being overwritten
+  std::atomic<uint64_t> seq{0};
+  TraceRecord record{};
+};
+
+// Written only by its thread, copied out by whoever asks for a dump
+struct TraceBuffer {
+  std::string thread_name;
+  uint32_t thread_id;
+  std::unique_ptr<TraceSlot[]> slots;
+  uint64_t mask;
+  std::atomic<uint64_t> head{0};
+
+  TraceBuffer(std::string thread_name, uint32_t thread_id, size_t capacity)
+      : thread_name(std::move(thread_name)),
+        thread_id(thread_id),
+        slots(std::make_unique<TraceSlot[]>(capacity)),
+        mask(capacity - 1) {}
+
+  auto write(const TraceRecord& record) -> void {
+    uint64_t seq = head.load(std::memory_order_relaxed) + 1;
+    TraceSlot& slot = slots[seq & mask];
+    slot.seq.store(0, std::memory_order_relaxed);
+    std::atomic_thread_fence(std::memory_order_release);
+    slot.record = record;
+    slot.seq.store(seq, std::memory_order_release);
+    head.store(seq, std::memory_order_release);
+  }
+
+  // Skips any record overwritten while it was being copied
+  auto copy_to(std::vector<TraceRecord>& out) const -> void {
+    uint64_t last = head.load(std::memory_order_acquire);
+    for (uint64_t seq = last > mask ? last - mask : 1; seq <= last; ++seq) {
+      const TraceSlot& slot = slots[seq & mask];
+      if (slot.seq.load(std::memory_order_acquire) != seq) {
+        continue;
+      }
+      TraceRecord record = slot.record;
+      std::atomic_thread_fence(std::memory_order_acquire);
+      if (slot.seq.load(std::memory_order_relaxed) == seq) {
+        out.push_back(record);
+      }
+    }
+  }
+};
+
+struct Tracer {
+  // 0 turns tracing off
+  uint32_t sample_every{0};
+  size_t buffer_capacity{1 << 16};
+  std::atomic<uint64_t> next_trace_id{1};
+  std::mutex buffers_mutex;
+  // Shared so a thread's records outlive the thread
+  std::vector<std::shared_ptr<TraceBuffer>> buffers;
+
+  static auto instance() -> Tracer& {
+    static Tracer tracer;
+    return tracer;
+  }
+
+  auto configure(uint32_t sample_every, size_t buffer_capacity) -> void {
+    this->sample_every = sample_every;
+    this->buffer_capacity =
+        std::bit_ceil(std::max<size_t>(buffer_capacity, 2));
+    if (sample_every != 0) {
+      TscClock::get();
+    }
+  }
+
+  // Threads that don't name themselves are numbered
+  auto add_buffer(std::string thread_name) -> std::shared_ptr<TraceBuffer> {
+    std::scoped_lock lock(buffers_mutex);
+    auto thread_id = static_cast<uint32_t>(buffers.size());
+    if (thread_name.empty()) {
+      thread_name = "thread " + std::to_string(thread_id);
+    }
+    return buffers.emplace_back(std::make_shared<TraceBuffer>(
+        std::move(thread_name), thread_id, buffer_capacity));
+  }
+
+  // Pairs each buffer's thread with a copy of its records
+  auto collect()
+      -> std::vector<std::pair<std::shared_ptr<TraceBuffer>,
+                               std::vector<TraceRecord>>> {
+    std::vector<std::shared_ptr<TraceBuffer>> snapshot;
+    {
+      std::scoped_lock lock(buffers_mutex);
+      snapshot = buffers;
+    }
+    std::vector<
+        std::pair<std::shared_ptr<TraceBuffer>, std::vector<TraceRecord>>>
+        collected;
+    for (auto& buffer : snapshot) {
+      std::vector<TraceRecord> records;
+      buffer->copy_to(records);
+      collected.emplace_back(buffer, std::move(records));
+    }
+    return collected;
+  }
+};
+
+/* Per-thread tracing state */
+inline thread_local uint64_t current_trace_id = 0;
+inline thread_local uint32_t messages_since_sample = 0;
+inline thread_local std::shared_ptr<TraceBuffer> thread_trace_buffer;
+
+// Gives the calling thread's records a name in the viewer, threads that
+// never call this are named when they first record
+inline auto name_trace_thread(std::string name) -> void {
+  if (Tracer::instance().sample_every != 0) {
+    thread_trace_buffer = Tracer::instance().add_buffer(std::move(name));
+  }
+}
+
+// Times a scope of the message being traced on this thread, if any. end()
+// records early, e.g. once a lock has been acquired.
+struct TraceSpan {
+  const char* name;
+  uint64_t start{0};
+
+  explicit TraceSpan(const char* name) : name(name) {
+    if (current_trace_id != 0) {
+      start = tsc();
+    }
+  }
+
+  TraceSpan(const TraceSpan&) = delete;
+  auto operator=(const TraceSpan&) -> TraceSpan& = delete;
+
+  ~TraceSpan() { end(); }
+
+  auto end() -> void {
+    if (start == 0) {
+      return;
+    }
+    if (!thread_trace_buffer) {
+      thread_trace_buffer = Tracer::instance().add_buffer({});
+    }
+    thread_trace_buffer->write({.name = name,
+                                .trace_id = current_trace_id,
+                                .start = start,
+                                .end = tsc()});
+    start = 0;
+  }
+};
+
+// Decides whether the message handled in this scope is sampled, and if so
+// traces it as the outermost span
+struct TraceRoot {
+  bool sampled;
+  TraceSpan span;
+
+  explicit TraceRoot(const char* name) : sampled(sample()), span(name) {}
+
+  ~TraceRoot() {
+    span.end();
+    current_trace_id = 0;
+  }
+
+  TraceRoot(const TraceRoot&) = delete;
+  auto operator=(const TraceRoot&) -> TraceRoot& = delete;
+
+  static auto sample() -> bool {
+    uint32_t sample_every = Tracer::instance().sample_every;
+    if (sample_every == 0 || ++messages_since_sample < sample_every) {
+      return false;
+    }
+    messages_since_sample = 0;
+    current_trace_id = Tracer::instance().next_trace_id++;
+    return true;
+  }
+};
@@ -0,0 +1,386 @@
+#pragma once
+
+#include <algorithm>
+#include <array>
+#include <chrono>
+#include <cstddef>
+#include <cstdint>
+#include <limits>
+#include <memory>
+#include <mutex>
+#include <vector>
+
+#include "Models.hpp"
+
+// Every fill on one book, kept for the whole game. Fills are appended to an
+// open block of plain columns, and full blocks are sealed into delta and
+// varint encoded columns, which takes a typical fill from 32 bytes to under
+// 10. Appending happens under the book lock, so it doesn't encode unless the
+// sealer falls far behind: a full block is swapped for a spare one and sealed
+// later by a background thread.
+// Sealed and full blocks never change, so a query only holds the tape's lock
+// long enough to share them and copy the open block.
+
+struct TapeTrade {
+  uint64_t seq;
+  int64_t time_ms;
+  uint32_t price;
+  uint32_t volume;
+  uint32_t buyer_id;
+  uint32_t seller_id;
+  uint32_t order_id;
+};
+
+struct TapeBlock {
+  static constexpr size_t NUM_COLUMNS = 6;
+
+  uint64_t first_seq;
+  uint32_t count;
+  int64_t first_time_ms;
+  int64_t last_time_ms;
+  // Columns back to back, each starting at column_offsets[i]
+  std::array<uint32_t, NUM_COLUMNS> column_offsets;
+  std::vector<uint8_t> bytes;
+
+  [[nodiscard]] auto last_seq() const -> uint64_t {
+    return first_seq + count - 1;
+  }
+
+  auto decode() const -> std::vector<TapeTrade>;
+};
+
+/* LEB128 varints of zigzagged deltas */
+
+auto inline zigzag(int64_t value) -> uint64_t {
+  return (static_cast<uint64_t>(value) << 1) ^
+         static_cast<uint64_t>(value >> 63);
+}
+
+auto inline unzigzag(uint64_t value) -> int64_t {
+  return static_cast<int64_t>(value >> 1) ^ -static_cast<int64_t>(value & 1);
+}
+
+auto inline put_varint(std::vector<uint8_t>& out, uint64_t value) -> void {
+  while (value >= 0x80) {
+    out.push_back(static_cast<uint8_t>(value | 0x80));
+    value >>= 7;
+  }
+  out.push_back(static_cast<uint8_t>(value));
+}
+
+auto inline get_varint(const uint8_t*& in) -> uint64_t {
+  uint64_t value = 0;
+  for (int shift = 0;; shift += 7) {
+    uint8_t byte = *in++;
+    value |= uint64_t{byte & 0x7fU} << shift;
+    if (byte < 0x80) {
+      return value;
+    }
+  }
+}
+
+// The open block, one vector per column
+struct TapeColumns {
+  std::vector<int64_t> time_ms;
+  std::array<std::vector<uint32_t>, TapeBlock::NUM_COLUMNS - 1> values;
+
+  auto reserve(size_t count) -> void {
+    time_ms.reserve(count);
+    for (auto& column : values) {
+      column.reserve(count);
+    }
+  }
+
+  [[nodiscard]] auto size() const -> size_t { return time_ms.size(); }
+
+  auto clear() -> void {
+    time_ms.clear();
+    for (auto& column : values) {
+      column.clear();
+    }
+  }
+
+  [[nodiscard]] auto row(uint64_t seq, size_t i) const -> TapeTrade {
+    return {.seq = seq,
+            .time_ms = time_ms[i],
+            .price = values[0][i],
+            .volume = values[1][i],
+            .buyer_id = values[2][i],
+            .seller_id = values[3][i],
+            .order_id = values[4][i]};
+  }
+
+  [[nodiscard]] auto seal(uint64_t first_seq) const -> TapeBlock {
+    TapeBlock block{.first_seq = first_seq,
+                    .count = static_cast<uint32_t>(size()),
+                    .first_time_ms = time_ms.front(),
+                    .last_time_ms = time_ms.back(),
+                    .column_offsets = {},
+                    .bytes = {}};
+    block.bytes.reserve(size() * 8);
+    block.column_offsets[0] = 0;
+    int64_t previous_time = 0;
+    for (int64_t time : time_ms) {
+      put_varint(block.bytes, zigzag(time - previous_time));
+      previous_time = time;
+    }
+    for (size_t c = 0; c < values.size(); ++c) {
+      block.column_offsets[c + 1] = static_cast<uint32_t>(block.bytes.size());
+      int64_t previous = 0;
+      for (uint32_t value : values[c]) {
+        put_varint(block.bytes, zigzag(int64_t{value} - previous));
+        previous = value;
+      }
+    }
+    block.bytes.shrink_to_fit();
+    return block;
+  }
+};
+
+auto inline TapeBlock::decode() const -> std::vector<TapeTrade> {
+  std::vector<TapeTrade> trades(count);
+  const uint8_t* in = bytes.data() + column_offsets[0];
+  int64_t time = 0;
+  for (uint32_t i = 0; i < count; ++i) {
+    time += unzigzag(get_varint(in));
+    trades[i].seq = first_seq + i;
+    trades[i].time_ms = time;
+  }
+  std::array<uint32_t TapeTrade::*, NUM_COLUMNS - 1> fields = {
+      &TapeTrade::price, &TapeTrade::volume, &TapeTrade::buyer_id,
+      &TapeTrade::seller_id, &TapeTrade::order_id};
+  for (size_t c = 0; c < fields.size(); ++c) {
+    in = bytes.data() + column_offsets[c + 1];
+    int64_t value = 0;
+    for (uint32_t i = 0; i < count; ++i) {
+      value += unzigzag(get_varint(in));
+      trades[i].*fields[c] = static_cast<uint32_t>(value);
+    }
+  }
+  return trades;
+}
+
+// What a query sees of the tape, taken without holding up the writer
+struct TapeSnapshot {
+  std::vector<std::shared_ptr<const TapeBlock>> blocks;
+  // Full blocks after the sealed ones, starting at pending_seq. Shared with
+  // the tape, which doesn't reuse them while a snapshot holds them.
+  std::vector<std::shared_ptr<const TapeColumns>> pending;
+  uint64_t pending_seq;
+  // The open block's fills
+  std::vector<TapeTrade> unsealed;
+};
+
+struct TradeTape {
+  static constexpr size_t BLOCK_SIZE = 4096;
+  // Emptied blocks kept for reuse, with one ready from the start the writer
+  // only allocates if it fills blocks faster than they're sealed
+  static constexpr size_t SPARE_BLOCKS = 2;
+  static constexpr auto SEAL_INTERVAL = std::chrono::milliseconds(50);
+  // Beyond this the writer seals the oldest full block itself, so a stalled
+  // sealer can't leave raw blocks piling up under the book lock
+  static constexpr size_t MAX_PENDING = 8;
+
+  std::mutex mutex;
+  std::vector<std::shared_ptr<const TapeBlock>> blocks;
+  // Full blocks in seq order, waiting for seal_pending
+  std::vector<std::shared_ptr<TapeColumns>> pending;
+  std::vector<std::shared_ptr<TapeColumns>> spare;
+  std::shared_ptr<TapeColumns> open;
+  uint64_t next_seq{1};
+
+  TradeTape() : open(make_columns()) {
+    pending.reserve(MAX_PENDING);
+    spare.reserve(SPARE_BLOCKS);
+    spare.push_back(make_columns());
+  }
+
+  static auto make_columns() -> std::shared_ptr<TapeColumns> {
+    auto columns = std::make_shared<TapeColumns>();
+    columns->reserve(BLOCK_SIZE);
+    return columns;
+  }
+
+  // Called with the book lock held, so the tape lock is only ever contended
+  // by a query copying unsealed fills or the sealer swapping a block
+  auto append(const Trade& trade, int64_t time_ms) -> void {
+    std::scoped_lock lock(mutex);
+    open->time_ms.push_back(time_ms);
+    open->values[0].push_back(trade.price);
+    open->values[1].push_back(trade.volume);
+    open->values[2].push_back(trade.buyer_id);
+    open->values[3].push_back(trade.seller_id);
+    open->values[4].push_back(trade.order_id);
+    ++next_seq;
+    if (open->size() == BLOCK_SIZE) {
+      if (pending.size() == MAX_PENDING) {
+        TapeBlock block = pending.front()->seal(sealed_seq());
+        commit(pending.front(), std::move(block));
+      }
+      pending.push_back(std::move(open));
+      if (spare.empty()) {
+        open = make_columns();
+      } else {
+        open = std::move(spare.back());
+        spare.pop_back();
+      }
+    }
+  }
+
+  // Seals every full block, from one background thread. Nothing writes to a
+  // full block, so it's encoded without holding the lock.
+  auto seal_pending() -> void {
+    while (true) {
+      std::shared_ptr<TapeColumns> columns;
+      uint64_t first_seq = 1;
+      {
+        std::scoped_lock lock(mutex);
+        if (pending.empty()) {
+          return;
+        }
+        columns = pending.front();
+        first_seq = sealed_seq();
+      }
+      TapeBlock block = columns->seal(first_seq);
+      std::scoped_lock lock(mutex);
+      // Unless the writer sealed it first
+      if (!pending.empty() && pending.front() == columns) {
+        columns.reset();
+        commit(pending.front(), std::move(block));
+      }
+    }
+  }
+
+  auto snapshot() -> TapeSnapshot {
+    std::scoped_lock lock(mutex);
+    TapeSnapshot snapshot{.blocks = blocks,
+                          .pending = {pending.begin(), pending.end()},
+                          .pending_seq = sealed_seq(),
+                          .unsealed = {}};
+    snapshot.unsealed.reserve(open->size());
+    uint64_t seq = next_seq - open->size();
+    for (size_t i = 0; i < open->size(); ++i) {
+      snapshot.unsealed.push_back(open->row(seq++, i));
+    }
+    return snapshot;
+  }
+
+  // The first seq after the sealed blocks, called with the lock held
+  [[nodiscard]] auto sealed_seq() const -> uint64_t {
+    return blocks.empty() ? 1 : blocks.back()->last_seq() + 1;
+  }
+
+  // Replaces the oldest full block with its sealed copy, with the lock held.
+  // `columns` is the only other reference to it once it's out of pending,
+  // unless a snapshot still shares it.
+  auto commit(std::shared_ptr<TapeColumns> columns, TapeBlock block) -> void {
+    blocks.push_back(std::make_shared<const TapeBlock>(std::move(block)));
+    pending.erase(pending.begin());
+    if (columns.use_count() == 1 && spare.size() < SPARE_BLOCKS) {
+      columns->clear();
+      spare.push_back(std::move(columns));
+    }
+  }
+
+  [[nodiscard]] auto compressed_bytes() -> size_t {
+    std::scoped_lock lock(mutex);
+    size_t total = 0;
+    for (const auto& block : blocks) {
+      total += block->bytes.size();
+    }
+    return total;
+  }
+};
+
+// Trades with seq in [from_seq, to_seq] and time in [from_ms, to_ms]
+struct TapeRange {
+  uint64_t from_seq{0};
+  uint64_t to_seq{std::numeric_limits<uint64_t>::max()};
+  int64_t from_ms{std::numeric_limits<int64_t>::min()};
+  int64_t to_ms{std::numeric_limits<int64_t>::max()};
+
+  [[nodiscard]] auto overlaps(const TapeBlock& block) const -> bool {
+    return block.first_seq <= to_seq && block.last_seq() >= from_seq &&
+           block.first_time_ms <= to_ms && block.last_time_ms >= from_ms;
+  }
+
+  [[nodiscard]] auto contains(const TapeTrade& trade) const -> bool {
+    return trade.seq >= from_seq && trade.seq <= to_seq &&
+           trade.time_ms >= from_ms && trade.time_ms <= to_ms;
+  }
+};
+
+// Walks a snapshot's matching trades a block at a time in seq order, so a
+// response can stop and pick up again as the socket drains. Blocks outside
+// the range are skipped without being decoded.
+struct TapeCursor {
+  const TapeSnapshot& snapshot;
+  TapeRange range;
+  size_t block;
+  size_t pending{0};
+  uint64_t pending_seq;
+  bool unsealed_done{false};
+
+  TapeCursor(const TapeSnapshot& snapshot, const TapeRange& range)
+      : snapshot(snapshot),
+        range(range),
+        // Blocks are in seq order, so the first candidate can be found
+        // directly
+        block(static_cast<size_t>(
+            std::ranges::partition_point(
+                snapshot.blocks,
+                [&range](const auto& candidate) {
+                  return candidate->last_seq() < range.from_seq;
+                }) -
+            snapshot.blocks.begin())),
+        pending_seq(snapshot.pending_seq) {}
+
+  // Replaces `matching` with the next non-empty batch, false when the range
+  // is exhausted
+  auto next(std::vector<TapeTrade>& matching) -> bool {
+    matching.clear();
+    while (block < snapshot.blocks.size()) {
+      const TapeBlock& candidate = *snapshot.blocks[block++];
+      if (candidate.first_seq > range.to_seq) {
+        block = snapshot.blocks.size();
+        pending = snapshot.pending.size();
+        unsealed_done = true;
+        return false;
+      }
+      if (!range.overlaps(candidate)) {
+        continue;
+      }
+      for (const TapeTrade& trade : candidate.decode()) {
+        if (range.contains(trade)) {
+          matching.push_back(trade);
+        }
+      }
+      if (!matching.empty()) {
+        return true;
+      }
+    }
+    while (pending < snapshot.pending.size()) {
+      const TapeColumns& columns = *snapshot.pending[pending++];
+      for (size_t i = 0; i < columns.size(); ++i) {
+        TapeTrade trade = columns.row(pending_seq + i, i);
+        if (range.contains(trade)) {
+          matching.push_back(trade);
+        }
+      }
+      pending_seq += columns.size();
+      if (!matching.empty()) {
+        return true;
+      }
+    }
+    if (unsealed_done) {
+      return false;
+    }
+    unsealed_done = true;
+    for (const TapeTrade& trade : snapshot.unsealed) {
+      if (range.contains(trade)) {
+        matching.push_back(trade);
+      }
+    }
+    return !matching.empty();
+  }
+};
@@ -0,0 +1,219 @@
+#pragma once
+
+#include <algorithm>
+#include <charconv>
+#include <chrono>
+#include <cstddef>
+#include <cstdint>
+#include <cstdio>
+#include <fstream>
+#include <iostream>
+#include <string>
+#include <string_view>
+#include <unordered_map>
+#include <utility>
+
+#include <fcntl.h>
+#include <sys/file.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+// Cookie the web app keeps its session key in
+constexpr std::string_view SESSION_COOKIE = "sessionid";
+
+struct UserInfo {
+  uint32_t user_id;
+  std::string username;
+};
+
+// Who each logged in session belongs to, so the game can answer who's asking
+// without a round trip to the web app. The web app appends a line to the file
+// on every login,
+//   <session key>\t<user_id>\t<expires, unix seconds>\t<username>
+// and just the session key on logout. Only new lines are read, at most every
+// REFRESH_INTERVAL and only when the file has grown. Once most lines are stale
+// the file is rewritten with just the live sessions. The keys are live
+// credentials, so a file anyone but its owner can read is ignored until its
+// mode is fixed.
+struct UserTable {
+  static constexpr auto REFRESH_INTERVAL = std::chrono::milliseconds(50);
+  static constexpr size_t COMPACT_LINES = 1024;
+
+  struct Session {
+    UserInfo user;
+    int64_t expires_at;
+  };
+
+  std::string path;
+  std::unordered_map<std::string, Session> sessions;
+  // Everything before this has been applied
+  std::streamoff offset{0};
+  // Lines up to offset, live or not
+  size_t lines{0};
+  std::chrono::steady_clock::time_point next_refresh{};
+  bool warned{false};
+
+  explicit UserTable(std::string path) : path(std::move(path)) {}
+
+  static auto unix_now() -> int64_t {
+    return std::chrono::duration_cast<std::chrono::seconds>(
+               std::chrono::system_clock::now().time_since_epoch())
+        .count();
+  }
+
+  auto refresh() -> void {
+    auto now = std::chrono::steady_clock::now();
+    if (now < next_refresh) {
+      return;
+    }
+    next_refresh = now + REFRESH_INTERVAL;
+    struct stat st {};
+    if (path.empty() || stat(path.c_str(), &st) != 0 || st.st_size == offset) {
+      return;
+    }
+    if ((st.st_mode & (S_IRWXG | S_IRWXO)) != 0) {
+      if (!warned) {
+        std::cerr << path << " is readable by other users, chmod 600 it\n";
+        warned = true;
+      }
+      return;
+    }
+    warned = false;
+    // Truncated or replaced, start over
+    if (st.st_size < offset) {
+      sessions.clear();
+      offset = 0;
+      lines = 0;
+    }
+    read_new_lines();
+    size_t stale = lines - sessions.size();
+    if (stale >= COMPACT_LINES && stale > sessions.size()) {
+      compact();
+    }
+  }
+
+  auto read_new_lines() -> void {
+    std::ifstream in(path, std::ios::binary);
+    in.seekg(offset);
+    std::string line;
+    while (std::getline(in, line)) {
+      // A line still being written is picked up next time
+      if (in.eof()) {
+        break;
+      }
+      offset += static_cast<std::streamoff>(line.size()) + 1;
+      ++lines;
+      apply(line);
+    }
+  }
+
+  // Renames a copy with only the unexpired sessions over the file. The web
+  // app appends under a shared flock and reopens if the file was replaced
+  // while it waited, so holding an exclusive one means no line is lost.
+  auto compact() -> void {
+    int fd = open(path.c_str(), O_RDONLY | O_CLOEXEC);
+    if (fd < 0) {
+      return;
+    }
+    if (flock(fd, LOCK_EX) != 0) {
+      close(fd);
+      return;
+    }
+    read_new_lines();
+    int64_t now = unix_now();
+    std::string contents;
+    for (auto it = sessions.begin(); it != sessions.end();) {
+      if (it->second.expires_at <= now) {
+        it = sessions.erase(it);
+        continue;
+      }
+      contents += it->first + '\t' + std::to_string(it->second.user.user_id) +
+                  '\t' + std::to_string(it->second.expires_at) + '\t' +
+                  it->second.user.username + '\n';
+      ++it;
+    }
+    std::string temp_path = path + ".tmp";
+    int temp =
+        open(temp_path.c_str(), O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0600);
+    bool written = temp >= 0 && fchmod(temp, 0600) == 0 &&
+                   write(temp, contents.data(), contents.size()) ==
+                       static_cast<ssize_t>(contents.size());
+    if (temp >= 0) {
+      written = close(temp) == 0 && written;
+    }
+    if (written && rename(temp_path.c_str(), path.c_str()) == 0) {
+      offset = static_cast<std::streamoff>(contents.size());
+      lines = sessions.size();
+    } else {
+      perror("compacting sessions");
+      unlink(temp_path.c_str());
+    }
+    close(fd);
+  }
+
+  auto apply(std::string_view line) -> void {
+    size_t key_end = line.find('\t');
+    std::string key(line.substr(0, key_end));
+    if (key_end == std::string_view::npos) {
+      sessions.erase(key);
+      return;
+    }
+    std::string_view rest = line.substr(key_end + 1);
+    uint32_t user_id = 0;
+    int64_t expires_at = 0;
+    if (!parse_field(rest, user_id) || !parse_field(rest, expires_at)) {
+      return;
+    }
+    sessions[key] = {.user = {.user_id = user_id, .username = std::string(rest)},
+                     .expires_at = expires_at};
+  }
+
+  // Parses up to the next tab into value and drops it from rest
+  template <typename T>
+  static auto parse_field(std::string_view& rest, T& value) -> bool {
+    size_t end = rest.find('\t');
+    if (end == std::string_view::npos) {
+      return false;
+    }
+    auto [ptr, ec] = std::from_chars(rest.data(), rest.data() + end, value);
+    if (ec != std::errc{} || ptr != rest.data() + end) {
+      return false;
+    }
+    rest.remove_prefix(end + 1);
+    return true;
+  }
+
+  [[nodiscard]] auto find(std::string_view session_key) -> const UserInfo* {
+    if (session_key.empty()) {
+      return nullptr;
+    }
+    refresh();
+    auto it = sessions.find(std::string(session_key));
+    if (it == sessions.end()) {
+      return nullptr;
+    }
+    if (it->second.expires_at <= unix_now()) {
+      sessions.erase(it);
+      return nullptr;
+    }
+    return &it->second.user;
+  }
+};
+
+// The value of cookie `name` in a Cookie header, empty when it isn't set
+inline auto cookie_value(std::string_view header, std::string_view name)
+    -> std::string_view {
+  while (!header.empty()) {
+    size_t end = std::min(header.find(';'), header.size());
+    std::string_view pair = header.substr(0, end);
+    while (!pair.empty() && pair.front() == ' ') {
+      pair.remove_prefix(1);
+    }
+    if (pair.size() > name.size() && pair.starts_with(name) &&
+        pair[name.size()] == '=') {
+      return pair.substr(name.size() + 1);
+    }
+    header.remove_prefix(std::min(end + 1, header.size()));
+  }
+  return {};
+}
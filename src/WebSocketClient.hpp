@@ -0,0 +1,288 @@
+#pragma once
+
+#include <algorithm>
+#include <array>
+#include <cstddef>
+#include <cstdint>
+#include <functional>
+#include <random>
+#include <string>
+#include <string_view>
+
+#include "libusockets.h"
+
+// Just enough of a WebSocket client (RFC 6455) for a relay to read an
+// exchange's feed over uSockets, on the caller's loop. Does the opening
+// handshake, reassembles the server's frames into messages, answers pings
+// and masks whatever it sends. TLS like the exchanges, without verifying
+// their certificate. The callbacks run on the loop thread and may send or
+// close, but a message's bytes are gone once it closes.
+struct WebSocketClient {
+  static constexpr int SSL = 1;
+  static constexpr uint8_t CONTINUATION = 0x0;
+  static constexpr uint8_t TEXT = 0x1;
+  static constexpr uint8_t BINARY = 0x2;
+  static constexpr uint8_t CLOSE = 0x8;
+  static constexpr uint8_t PING = 0x9;
+  static constexpr uint8_t PONG = 0xa;
+
+  std::string host;
+  int port;
+  std::string path;
+  // Once the server accepted the upgrade
+  std::function<void()> on_open;
+  // A whole text or binary message, valid for the call
+  std::function<void(std::string_view)> on_message;
+  // The connection failed or went away, connect again later to retry
+  std::function<void()> on_close;
+
+  us_socket_t* socket{nullptr};
+  bool upgraded{false};
+  // Bytes read but not parsed yet, then fragments of the current message
+  std::string received;
+  std::string message;
+  // Bytes the kernel didn't take yet, written on the next writable
+  std::string unsent;
+  std::string frame;
+  std::mt19937 masks{std::random_device{}()};
+
+  WebSocketClient(std::string host, int port, std::string path)
+      : host(std::move(host)), port(port), path(std::move(path)) {}
+
+  WebSocketClient(const WebSocketClient&) = delete;
+  auto operator=(const WebSocketClient&) -> WebSocketClient& = delete;
+
+  // One per loop, shared by every client on it
+  static auto create_context(us_loop_t* loop) -> us_socket_context_t*;
+
+  [[nodiscard]] auto connected() const -> bool { return socket != nullptr; }
+
+  auto connect(us_socket_context_t* context) -> void {
+    if (socket != nullptr) {
+      return;
+    }
+    socket = us_socket_context_connect(SSL, context, host.c_str(), port,
+                                       nullptr, 0, sizeof(WebSocketClient*));
+    if (socket == nullptr) {
+      if (on_close) {
+        on_close();
+      }
+      return;
+    }
+    *static_cast<WebSocketClient**>(us_socket_ext(SSL, socket)) = this;
+  }
+
+  auto close() -> void {
+    if (socket != nullptr) {
+      us_socket_close(SSL, socket, 0, nullptr);
+    }
+  }
+
+  auto send(std::string_view payload, uint8_t opcode = TEXT) -> void {
+    if (!upgraded) {
+      return;
+    }
+    frame.clear();
+    frame.push_back(static_cast<char>(0x80 | opcode));
+    if (payload.size() < 126) {
+      frame.push_back(static_cast<char>(0x80 | payload.size()));
+    } else if (payload.size() <= 0xffff) {
+      frame.push_back(static_cast<char>(0x80 | 126));
+      append_big_endian(payload.size(), 2);
+    } else {
+      frame.push_back(static_cast<char>(0x80 | 127));
+      append_big_endian(payload.size(), 8);
+    }
+    auto mask = static_cast<uint32_t>(masks());
+    std::array<char, 4> key{};
+    for (size_t i = 0; i < key.size(); ++i) {
+      key[i] = static_cast<char>(mask >> (8 * i));
+    }
+    frame.append(key.data(), key.size());
+    for (size_t i = 0; i < payload.size(); ++i) {
+      frame.push_back(static_cast<char>(payload[i] ^ key[i % 4]));
+    }
+    write(frame);
+  }
+
+ private:
+  auto append_big_endian(uint64_t value, int bytes) -> void {
+    for (int i = bytes - 1; i >= 0; --i) {
+      frame.push_back(static_cast<char>(value >> (8 * i)));
+    }
+  }
+
+  auto write(std::string_view bytes) -> void {
+    if (socket == nullptr) {
+      return;
+    }
+    if (!unsent.empty()) {
+      unsent.append(bytes);
+      return;
+    }
+    int written = us_socket_write(SSL, socket, bytes.data(),
+                                  static_cast<int>(bytes.size()), 0);
+    unsent.append(bytes.substr(static_cast<size_t>(std::max(written, 0))));
+  }
+
+  auto on_writable() -> void {
+    if (unsent.empty()) {
+      return;
+    }
+    int written = us_socket_write(SSL, socket, unsent.data(),
+                                  static_cast<int>(unsent.size()), 0);
+    unsent.erase(0, static_cast<size_t>(std::max(written, 0)));
+  }
+
+  auto on_connected() -> void {
+    // The key only has to look random, nothing here checks the answer to it
+    static constexpr std::string_view BASE64 =
+        "ABCDEFGHIJKLMNOPQRSTUVWXYZabcdefghijklmnopqrstuvwxyz0123456789+/";
+    std::string key;
+    for (int i = 0; i < 21; ++i) {
+      key.push_back(BASE64[masks() % BASE64.size()]);
+    }
+    key += "A==";
+    std::string request = "GET " + path + " HTTP/1.1\r\nHost: " + host + ":" +
+                          std::to_string(port) +
+                          "\r\nUpgrade: websocket\r\nConnection: Upgrade\r\n"
+                          "Sec-WebSocket-Key: " +
+                          key + "\r\nSec-WebSocket-Version: 13\r\n\r\n";
+    write(request);
+  }
+
+  auto on_data(std::string_view data) -> void {
+    received.append(data);
+    if (!upgraded) {
+      size_t end = received.find("\r\n\r\n");
+      if (end == std::string::npos) {
+        return;
+      }
+      if (!received.starts_with("HTTP/1.1 101")) {
+        close();
+        return;
+      }
+      received.erase(0, end + 4);
+      upgraded = true;
+      if (on_open) {
+        on_open();
+      }
+    }
+    parse_frames();
+  }
+
+  auto parse_frames() -> void {
+    size_t pos = 0;
+    while (socket != nullptr && received.size() - pos >= 2) {
+      auto byte = [this, pos](size_t i) -> uint8_t {
+        return static_cast<uint8_t>(received[pos + i]);
+      };
+      bool fin = (byte(0) & 0x80) != 0;
+      uint8_t opcode = byte(0) & 0x0f;
+      // Servers never mask
+      if ((byte(1) & 0x80) != 0) {
+        close();
+        return;
+      }
+      uint64_t length = byte(1) & 0x7f;
+      size_t header = 2;
+      if (length >= 126) {
+        size_t extended = length == 126 ? 2 : 8;
+        if (received.size() - pos < header + extended) {
+          break;
+        }
+        length = 0;
+        for (size_t i = 0; i < extended; ++i) {
+          length = (length << 8) | byte(header + i);
+        }
+        header += extended;
+      }
+      if (received.size() - pos - header < length) {
+        break;
+      }
+      std::string_view payload(received.data() + pos + header,
+                               static_cast<size_t>(length));
+      pos += header + static_cast<size_t>(length);
+      switch (opcode) {
+      case CONTINUATION:
+      case TEXT:
+      case BINARY:
+        if (fin && message.empty()) {
+          on_message(payload);
+          break;
+        }
+        message.append(payload);
+        if (fin) {
+          on_message(message);
+          message.clear();
+        }
+        break;
+      case PING:
+        send(payload, PONG);
+        break;
+      case CLOSE:
+        close();
+        return;
+      default:
+        break;
+      }
+    }
+    // Closing cleared what was left
+    if (socket != nullptr) {
+      received.erase(0, pos);
+    }
+  }
+
+  auto on_closed() -> void {
+    socket = nullptr;
+    upgraded = false;
+    received.clear();
+    message.clear();
+    unsent.clear();
+    if (on_close) {
+      on_close();
+    }
+  }
+
+  static auto from(us_socket_t* s) -> WebSocketClient* {
+    return *static_cast<WebSocketClient**>(us_socket_ext(SSL, s));
+  }
+};
+
+inline auto WebSocketClient::create_context(us_loop_t* loop)
+    -> us_socket_context_t* {
+  us_socket_context_t* context =
+      us_create_socket_context(SSL, loop, 0, us_socket_context_options_t{});
+  us_socket_context_on_open(
+      SSL, context,
+      [](us_socket_t* s, int /*is_client*/, char* /*ip*/,
+         int /*ip_length*/) -> us_socket_t* {
+        from(s)->on_connected();
+        return s;
+      });
+  us_socket_context_on_data(
+      SSL, context, [](us_socket_t* s, char* data, int length) -> us_socket_t* {
+        from(s)->on_data({data, static_cast<size_t>(length)});
+        return s;
+      });
+  us_socket_context_on_writable(SSL, context,
+                                [](us_socket_t* s) -> us_socket_t* {
+                                  from(s)->on_writable();
+                                  return s;
+                                });
+  us_socket_context_on_end(SSL, context, [](us_socket_t* s) -> us_socket_t* {
+    return us_socket_close(SSL, s, 0, nullptr);
+  });
+  us_socket_context_on_close(
+      SSL, context,
+      [](us_socket_t* s, int /*code*/, void* /*reason*/) -> us_socket_t* {
+        from(s)->on_closed();
+        return s;
+      });
+  us_socket_context_on_connect_error(
+      SSL, context, [](us_socket_t* s, int /*code*/) -> us_socket_t* {
+        from(s)->on_closed();
+        return s;
+      });
+  return context;
+}
@@ -1,23 +1,165 @@
+#include <algorithm>
+#include <atomic>
+#include <cassert>
+#include <cstddef>
 #include <chrono>
 #include <cstdint>
+#include <cstdlib>
 #include <iostream>
 #include <latch>
 #include <mutex>
+#include <new>
 #include <numeric>
 #include <random>
 #include <semaphore>
+#include <string>
 #include <thread>
 #include <unordered_set>
 #include <vector>
 
+#include "Auditor.hpp"
 #include "Exchange.hpp"
+#include "FeedOutbox.hpp"
 #include "Models.hpp"
+#include "TradeTape.hpp"
 
 // NOLINTNEXTLINE(cppcoreguidelines-avoid-non-const-global-variables)
 std::mutex output_mutex;
 
+Ledger ledger;
 std::vector<Exchange> exchanges;
 
+// Counts heap allocations made by the current thread
+thread_local size_t allocations = 0;
+
+// Every replaceable form is defined so each new is paired with a delete from
+// the same family. They're all out of line, an inlined malloc/free on one
+// side makes GCC report mismatched pairs.
+[[gnu::noinline]] auto counted_alloc(size_t size, std::align_val_t alignment)
+    -> void * {
+  ++allocations;
+  auto align = static_cast<size_t>(alignment);
+  // aligned_alloc wants a multiple of the alignment, and size 0 is allowed
+  size_t rounded = (std::max<size_t>(size, 1) + align - 1) / align * align;
+  if (align <= alignof(std::max_align_t)) {
+    return std::malloc(rounded);
+  }
+  return std::aligned_alloc(align, rounded);
+}
+
+[[gnu::noinline]] auto operator new(size_t size) -> void * {
+  if (void *ptr = counted_alloc(size, std::align_val_t{1})) {
+    return ptr;
+  }
+  throw std::bad_alloc();
+}
+
+[[gnu::noinline]] auto operator new[](size_t size) -> void * {
+  return operator new(size);
+}
+
+[[gnu::noinline]] auto operator new(size_t size, std::align_val_t alignment)
+    -> void * {
+  if (void *ptr = counted_alloc(size, alignment)) {
+    return ptr;
+  }
+  throw std::bad_alloc();
+}
+
+[[gnu::noinline]] auto operator new[](size_t size, std::align_val_t alignment)
+    -> void * {
+  return operator new(size, alignment);
+}
+
+[[gnu::noinline]] auto operator new(size_t size,
+                                    const std::nothrow_t & /*tag*/) noexcept
+    -> void * {
+  return counted_alloc(size, std::align_val_t{1});
+}
+
+[[gnu::noinline]] auto operator new[](size_t size,
+                                      const std::nothrow_t & /*tag*/) noexcept
+    -> void * {
+  return counted_alloc(size, std::align_val_t{1});
+}
+
+[[gnu::noinline]] auto operator new(size_t size, std::align_val_t alignment,
+                                    const std::nothrow_t & /*tag*/) noexcept
+    -> void * {
+  return counted_alloc(size, alignment);
+}
+
+[[gnu::noinline]] auto operator new[](size_t size, std::align_val_t alignment,
+                                      const std::nothrow_t & /*tag*/) noexcept
+    -> void * {
+  return counted_alloc(size, alignment);
+}
+
+[[gnu::noinline]] auto operator delete(void *ptr) noexcept -> void {
+  std::free(ptr);
+}
+
+[[gnu::noinline]] auto operator delete[](void *ptr) noexcept -> void {
+  std::free(ptr);
+}
+
+[[gnu::noinline]] auto operator delete(void *ptr, size_t /*size*/) noexcept
+    -> void {
+  std::free(ptr);
+}
+
+[[gnu::noinline]] auto operator delete[](void *ptr, size_t /*size*/) noexcept
+    -> void {
+  std::free(ptr);
+}
+
+[[gnu::noinline]] auto operator delete(void *ptr,
+                                       std::align_val_t /*alignment*/) noexcept
+    -> void {
+  std::free(ptr);
+}
+
+[[gnu::noinline]] auto operator delete[](
+    void *ptr, std::align_val_t /*alignment*/) noexcept -> void {
+  std::free(ptr);
+}
+
+[[gnu::noinline]] auto operator delete(void *ptr, size_t /*size*/,
+                                       std::align_val_t /*alignment*/) noexcept
+    -> void {
+  std::free(ptr);
+}
+
+[[gnu::noinline]] auto operator delete[](
+    void *ptr, size_t /*size*/, std::align_val_t /*alignment*/) noexcept
+    -> void {
+  std::free(ptr);
+}
+
+[[gnu::noinline]] auto operator delete(void *ptr,
+                                       const std::nothrow_t & /*tag*/) noexcept
+    -> void {
+  std::free(ptr);
+}
+
+[[gnu::noinline]] auto operator delete[](
+    void *ptr, const std::nothrow_t & /*tag*/) noexcept -> void {
+  std::free(ptr);
+}
+
+[[gnu::noinline]] auto operator delete(void *ptr,
+                                       std::align_val_t /*alignment*/,
+                                       const std::nothrow_t & /*tag*/) noexcept
+    -> void {
+  std::free(ptr);
+}
+
+[[gnu::noinline]] auto operator delete[](
+    void *ptr, std::align_val_t /*alignment*/,
+    const std::nothrow_t & /*tag*/) noexcept -> void {
+  std::free(ptr);
+}
+
 auto generate_user_ids(size_t num_users) -> std::vector<uint32_t> {
   std::vector<uint32_t> user_ids(num_users);
   std::iota(user_ids.begin(), user_ids.end(), 0);
@@ -55,8 +197,41 @@ auto generate_orders(Asset asset, const std::vector<uint32_t> &user_ids,
   return orders;
 }
 
+// Returns the steady state allocation count
 auto benchmark(Exchange &exchange, const std::vector<uint32_t> &user_ids,
-               size_t num_orders) -> void {
+               size_t num_orders) -> size_t {
+  // What the server hangs off each book, drained after every order the way
+  // Venue::flush does. An order fills at most one resting order per unit of
+  // volume and touches both sides of each fill.
+  FeedOutbox outbox;
+  FeedOutbox draining;
+  std::vector<uint32_t> changed_users;
+  std::vector<uint32_t> pushing;
+  TradeTape tape;
+  for (FeedOutbox *buffers : {&outbox, &draining}) {
+    buffers->events.reserve(1);
+    buffers->trades.reserve(MAX_VOLUME);
+  }
+  changed_users.reserve(2 * MAX_VOLUME + 1);
+  pushing.reserve(2 * MAX_VOLUME + 1);
+  exchange.outbox = &outbox;
+  exchange.changed_users = &changed_users;
+  exchange.tape = &tape;
+  // The server seals the tape on its own thread, so that isn't counted
+  size_t sealing_allocations = 0;
+  auto drain = [&]() {
+    {
+      std::scoped_lock lock(exchange.book_mutex());
+      outbox.take(draining);
+      changed_users.swap(pushing);
+    }
+    draining.clear();
+    pushing.clear();
+    size_t before = allocations;
+    tape.seal_pending();
+    sealing_allocations += allocations - before;
+  };
+
   auto t_start = std::chrono::high_resolution_clock::now();
   for (uint32_t user_id : user_ids) {
     exchange.register_user(user_id, 100'000'000, 100'000'000);
@@ -72,24 +247,48 @@ auto benchmark(Exchange &exchange, const std::vector<uint32_t> &user_ids,
 
   std::vector<Order> orders =
       generate_orders(exchange.asset, user_ids, num_orders);
+  // Planned for the worst case, where every order rests
+  exchange.prefault(user_ids.size(), num_orders);
 
+  // The first half of the orders warms up the book, the second half is
+  // steady state and shouldn't allocate
+  size_t warm_allocations = 0;
+  size_t warm_sealing_allocations = 0;
+  drain();
   t_start = std::chrono::high_resolution_clock::now();
-  for (Order order : orders) {
+  for (size_t i = 0; i < orders.size(); ++i) {
+    if (i == orders.size() / 2) {
+      warm_allocations = allocations;
+      warm_sealing_allocations = sealing_allocations;
+    }
+    const Order &order = orders[i];
     auto res = exchange.place_order(order.side, order.user_id, order.price,
                                     order.volume);
     if (res.error.has_value()) {
       std::scoped_lock lock(output_mutex);
       std::cout << res.error.value() << std::endl;
     }
+    drain();
   }
   t_end = std::chrono::high_resolution_clock::now();
+  size_t steady_allocations = allocations - warm_allocations -
+                              (sealing_allocations - warm_sealing_allocations);
+  exchange.outbox = nullptr;
+  exchange.changed_users = nullptr;
+  exchange.tape = nullptr;
 
   {
     std::scoped_lock lock(output_mutex);
     std::cout << "Placing orders took: "
               << std::chrono::duration<double, std::milli>(t_end - t_start)
               << std::endl;
+    std::cout << "Steady state allocations: " << steady_allocations << " over "
+              << orders.size() - orders.size() / 2 << " orders ("
+              << static_cast<double>(steady_allocations) /
+                     static_cast<double>(orders.size() - orders.size() / 2)
+              << " per order)" << std::endl;
   }
+  return steady_allocations;
 }
 
 auto benchmark_to_csv(Exchange &exchange, const std::vector<uint32_t> &user_ids,
@@ -121,9 +320,9 @@ auto benchmark_to_csv(Exchange &exchange, const std::vector<uint32_t> &user_ids,
       std::scoped_lock lock(output_mutex);
       std::cout << res.error.value() << std::endl;
     }
-    if (res.trades.has_value()) {
+    if (!res.trades.empty()) {
       std::scoped_lock lock(output_mutex);
-      for (const Trade &trade : res.trades.value()) {
+      for (const Trade &trade : res.trades) {
         std::cout << ",,,,," << to_string(exchange.asset) << ","
                   << trade.buyer_id << "," << trade.seller_id << ","
                   << trade.price << "," << trade.volume << std::endl;
@@ -145,8 +344,8 @@ auto example(Exchange &exchange) -> void {
   if (res.error.has_value()) {
     std::cout << res.error.value() << std::endl;
   }
-  if (res.trades.has_value()) {
-    for (const Trade &trade : res.trades.value()) {
+  if (!res.trades.empty()) {
+    for (const Trade &trade : res.trades) {
       std::cout << "buyer_id: " << trade.buyer_id
                 << ", seller_id: " << trade.seller_id << ", price "
                 << trade.price << ", volume: " << trade.volume << std::endl;
@@ -159,6 +358,7 @@ auto example(Exchange &exchange) -> void {
 constexpr size_t NUM_ASSETS = 4;
 std::latch latch{NUM_ASSETS};
 std::mutex mut;
+std::atomic<size_t> total_steady_allocations{0};
 
 auto main() -> int {
   std::vector<std::thread *> threads(NUM_ASSETS);
@@ -169,11 +369,12 @@ auto main() -> int {
     threads[i] = new std::thread([i, user_ids]() {
       {
         std::lock_guard lg(mut);
-        exchanges.emplace_back(static_cast<Asset>(i % 4));
+        exchanges.emplace_back(static_cast<Asset>(i % 4), ledger);
       }
       latch.arrive_and_wait();
 
-      benchmark(exchanges[i], user_ids, 1'000'000);
+      total_steady_allocations +=
+          benchmark(exchanges[i], user_ids, 1'000'000);
     });
   }
 
@@ -182,7 +383,15 @@ auto main() -> int {
     delete t;
   });
 
-  Exchange::verify_state(exchanges);
+  std::vector<std::string> violations = audit(exchanges);
+  for (const std::string &violation : violations) {
+    std::cout << violation << '\n';
+  }
+  assert(violations.empty());
 
+  // Anything the order path allocates once warm is a regression
+  if (total_steady_allocations != 0 || !violations.empty()) {
+    return 1;
+  }
   return 0;
 }
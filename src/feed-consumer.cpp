@@ -0,0 +1,113 @@
+// Sample consumer for the shared memory feed, run the server with
+// ZINGERS_SHM_FEED=1 and then `./feed-consumer [game_id] [asset...]`
+#include <charconv>
+#include <chrono>
+#include <cstdint>
+#include <iostream>
+#include <memory>
+#include <string_view>
+#include <thread>
+#include <vector>
+
+#include "Models.hpp"
+#include "ShmFeed.hpp"
+
+auto operator<<(std::ostream &os, const FeedEvent &event) -> std::ostream & {
+  os << event.seq << ' ' << to_string(event.asset) << ' ';
+  switch (event.type) {
+  case FEED_ORDER:
+    os << "ORDER " << (event.side == BUY ? "BUY" : "SELL")
+       << " order_id: " << event.order_id << ", user_id: " << event.user_id;
+    break;
+  case FEED_TRADE:
+    os << "TRADE order_id: " << event.order_id
+       << ", buyer_id: " << event.user_id
+       << ", seller_id: " << event.seller_id;
+    break;
+  case FEED_FILLED:
+    os << "FILLED " << (event.side == BUY ? "BUY" : "SELL")
+       << " user_id: " << event.user_id;
+    break;
+  case FEED_CANCEL:
+    os << "CANCEL " << (event.side == BUY ? "BUY" : "SELL")
+       << " order_id: " << event.order_id << ", user_id: " << event.user_id;
+    break;
+  }
+  return os << ", price: " << event.price << ", volume: " << event.volume;
+}
+
+auto main(int argc, char **argv) -> int {
+  uint32_t game_id = 0;
+  int first_asset = 1;
+  if (argc > 1) {
+    std::string_view arg(argv[1]);
+    auto [ptr, ec] = std::from_chars(arg.data(), arg.data() + arg.size(),
+                                     game_id);
+    if (ec == std::errc{} && ptr == arg.data() + arg.size()) {
+      first_asset = 2;
+    }
+  }
+
+  std::vector<Asset> assets;
+  for (int i = first_asset; i < argc; ++i) {
+    std::optional<Asset> asset = parse_asset(argv[i]);
+    if (!asset.has_value()) {
+      std::cerr << "Unknown asset " << argv[i] << '\n';
+      return 1;
+    }
+    assets.push_back(asset.value());
+  }
+  if (assets.empty()) {
+    assets = {DRESSING, RYE, SWISS, PASTRAMI};
+  }
+
+  std::vector<std::unique_ptr<ShmFeedReader>> readers;
+  for (Asset asset : assets) {
+    auto reader = ShmFeedReader::open(game_id, asset);
+    if (!reader) {
+      return 1;
+    }
+    readers.push_back(std::move(reader));
+  }
+
+  // Spin briefly for the next event, then back off so an idle feed doesn't
+  // hold a core
+  constexpr uint32_t SPINS_BEFORE_SLEEP = 1000;
+  constexpr auto IDLE_SLEEP = std::chrono::microseconds(100);
+  uint32_t idle_rounds = 0;
+  FeedEvent event{};
+  while (true) {
+    bool idle = true;
+    for (auto &reader : readers) {
+      switch (reader->poll(event)) {
+      case FeedPoll::EVENT: {
+        idle = false;
+        auto now = static_cast<uint64_t>(
+            std::chrono::duration_cast<std::chrono::nanoseconds>(
+                std::chrono::steady_clock::now().time_since_epoch())
+                .count());
+        std::cout << event << " (" << now - event.timestamp_ns << "ns)\n";
+        break;
+      }
+      case FeedPoll::GAP:
+        idle = false;
+        std::cout << "Fell behind, skipped " << reader->lost << " events\n";
+        break;
+      case FeedPoll::EMPTY:
+        break;
+      }
+    }
+    if (!idle) {
+      idle_rounds = 0;
+      continue;
+    }
+    if (idle_rounds == 0) {
+      std::cout.flush();
+    }
+    if (++idle_rounds < SPINS_BEFORE_SLEEP) {
+      std::this_thread::yield();
+    } else {
+      std::this_thread::sleep_for(IDLE_SLEEP);
+    }
+  }
+}
@@ -0,0 +1,410 @@
+// Differential fuzzer for the matching engine. Drives the production books
+// and the model in ReferenceExchange.hpp with the same orders and cancels,
+// random and adversarial, and stops at the first fill, reject, resting
+// order or balance they disagree on. Run `./fuzz [seed] [rounds]`. A failure
+// prints the round's seed, and passing that seed with one round replays it.
+#include <algorithm>
+#include <array>
+#include <charconv>
+#include <cstdint>
+#include <cstdlib>
+#include <iostream>
+#include <limits>
+#include <memory>
+#include <optional>
+#include <random>
+#include <sstream>
+#include <string>
+#include <string_view>
+#include <type_traits>
+#include <vector>
+
+#include "Auditor.hpp"
+#include "Exchange.hpp"
+#include "Models.hpp"
+#include "PriceGrid.hpp"
+#include "ReferenceExchange.hpp"
+
+constexpr size_t OPS_PER_ROUND = 4000;
+// Full balance and book comparisons are O(book), so only every so often
+constexpr size_t CHECK_EVERY = 64;
+// Cents up to $50,000, the kind of range the sparse layout exists for
+constexpr uint32_t WIDE_MAX_PRICE = 5'000'000;
+
+constexpr auto ASSETS = [] {
+  std::array<Asset, ASSET_VALUES.size()> assets{};
+  for (size_t i = 0; i < assets.size(); ++i) {
+    assets[i] = static_cast<Asset>(i);
+  }
+  return assets;
+}();
+
+struct Op {
+  bool cancel;
+  Asset asset;
+  Side side;
+  uint32_t user_id;
+  uint32_t price;
+  uint32_t volume;
+  uint32_t order_id;
+};
+
+auto describe(const Op& op) -> std::string {
+  std::ostringstream out;
+  if (op.cancel) {
+    out << "cancel " << to_string(op.asset) << " order " << op.order_id;
+  } else {
+    out << "user " << op.user_id << " " << (op.side == BUY ? "BUY" : "SELL")
+        << " " << op.volume << " " << to_string(op.asset) << " at "
+        << op.price;
+  }
+  return out.str();
+}
+
+auto describe(const Trade& trade) -> std::string {
+  std::ostringstream out;
+  out << "{buyer " << trade.buyer_id << ", seller " << trade.seller_id
+      << ", price " << trade.price << ", volume " << trade.volume
+      << ", order " << trade.order_id << "}";
+  return out.str();
+}
+
+auto describe(const std::optional<Order>& order) -> std::string {
+  if (!order.has_value()) {
+    return "none";
+  }
+  std::ostringstream out;
+  out << "{user " << order->user_id << ", "
+      << (order->side == BUY ? "BUY" : "SELL") << ", price " << order->price
+      << ", volume " << order->volume << ", order " << order->order_id << "}";
+  return out.str();
+}
+
+auto same_order(const Order& a, const Order& b) -> bool {
+  return a.asset == b.asset && a.side == b.side && a.user_id == b.user_id &&
+         a.price == b.price && a.volume == b.volume &&
+         a.order_id == b.order_id;
+}
+
+auto same_trade(const Trade& a, const Trade& b) -> bool {
+  return a.buyer_id == b.buyer_id && a.seller_id == b.seller_id &&
+         a.price == b.price && a.volume == b.volume &&
+         a.order_id == b.order_id;
+}
+
+// Prices and volumes either side of every limit
+constexpr auto edge_prices(uint32_t min_price, uint32_t max_price)
+    -> std::array<uint32_t, 9> {
+  return {0,
+          min_price,
+          min_price + 1,
+          max_price / 2,
+          max_price - 1,
+          max_price,
+          max_price + 1,
+          std::numeric_limits<uint32_t>::max() / max_price,
+          std::numeric_limits<uint32_t>::max()};
+}
+constexpr std::array<uint32_t, 7> EDGE_VOLUMES = {
+    0, 1, 2, 1000, 65536, std::numeric_limits<uint32_t>::max() / 2,
+    std::numeric_limits<uint32_t>::max()};
+
+// The spacing of generated prices, one tick over the configured range and
+// proportionally wider over wider ones, so the same walk covers the range
+constexpr auto price_step(uint32_t min_price, uint32_t max_price) -> uint32_t {
+  constexpr auto DEFAULT_RANGE = static_cast<uint32_t>(MAX_PRICE - MIN_PRICE);
+  return std::max<uint32_t>(1, (max_price - min_price) / DEFAULT_RANGE);
+}
+
+// One round's orders. Random ones cluster around a drifting mid so books
+// cross often, adversarial ones mix in edge values, unknown users, and
+// cancels of filled, cancelled, foreign and never issued ids. Over a wide
+// range the walk takes proportionally bigger steps, and half the prices are
+// knocked off the step so levels don't all line up.
+struct OpGenerator {
+  std::mt19937_64 rng;
+  uint32_t num_users;
+  bool adversarial;
+  uint32_t min_price;
+  uint32_t max_price;
+  uint32_t step;
+  std::array<uint32_t, 9> edges;
+  std::array<int64_t, ASSET_VALUES.size()> mid{};
+  std::vector<std::pair<Asset, uint32_t>> issued;
+
+  OpGenerator(uint64_t seed, uint32_t num_users, bool adversarial,
+              uint32_t min_price, uint32_t max_price)
+      : rng(seed),
+        num_users(num_users),
+        adversarial(adversarial),
+        min_price(min_price),
+        max_price(max_price),
+        step(price_step(min_price, max_price)),
+        edges(edge_prices(min_price, max_price)) {
+    mid.fill((int64_t{min_price} + max_price) / 2);
+  }
+
+  auto chance(uint32_t percent) -> bool { return rng() % 100 < percent; }
+
+  template <typename T> auto pick(const T& values) {
+    return values[rng() % values.size()];
+  }
+
+  auto next() -> Op {
+    Op op{.cancel = false,
+          .asset = static_cast<Asset>(rng() % ASSET_VALUES.size()),
+          .side = chance(50) ? BUY : SELL,
+          .user_id = static_cast<uint32_t>(rng() % num_users),
+          .price = 0,
+          .volume = 0,
+          .order_id = 0};
+    if (chance(25)) {
+      op.cancel = true;
+      if (!issued.empty() && !(adversarial && chance(30))) {
+        auto [asset, order_id] = pick(issued);
+        op.asset = adversarial && chance(20) ? op.asset : asset;
+        op.order_id = order_id;
+      } else {
+        op.order_id = static_cast<uint32_t>(rng());
+      }
+      return op;
+    }
+    if (adversarial && chance(5)) {
+      op.user_id = num_users + static_cast<uint32_t>(rng() % 3);
+    }
+    int64_t& asset_mid = mid[op.asset];
+    int64_t margin = int64_t{10} * step;
+    asset_mid = std::clamp(asset_mid + (static_cast<int64_t>(rng() % 5) - 2) *
+                                           step,
+                           min_price + margin, max_price - margin);
+    int64_t offset = static_cast<int64_t>(rng() % 13) - 6;
+    int64_t price = asset_mid + (offset + (op.side == BUY ? 1 : -1)) * step;
+    if (step > 1 && chance(50)) {
+      price -= static_cast<int64_t>(rng() % step);
+    }
+    op.price = static_cast<uint32_t>(price);
+    op.volume = 1 + static_cast<uint32_t>(rng() % 40);
+    if (adversarial && chance(30)) {
+      op.price = pick(edges);
+    }
+    if (adversarial && chance(30)) {
+      op.volume = pick(EDGE_VOLUMES);
+    }
+    return op;
+  }
+};
+
+template <typename Book> struct Round {
+  using Grid = decltype(Book::buy_orders);
+
+  uint64_t seed;
+  Ledger ledger;
+  std::vector<Book> exchanges;
+  ReferenceExchange reference;
+  uint32_t num_users;
+  size_t fills{0};
+  size_t rejects{0};
+
+  Round(uint64_t seed, uint32_t num_users) : seed(seed), num_users(num_users) {
+    std::mt19937_64 rng(seed ^ 0x5eed);
+    reference.min_price = Grid::MIN;
+    reference.max_price = Grid::MAX;
+    for (Asset asset : ASSETS) {
+      exchanges.emplace_back(asset, ledger);
+    }
+    // Cash scales with prices so a wide range trades as much as the default
+    uint64_t step = price_step(Grid::MIN, Grid::MAX);
+    for (uint32_t user_id = 0; user_id < num_users; ++user_id) {
+      // Some users are nearly broke so rejects and partial reservations
+      // happen alongside ordinary trading
+      uint64_t cash =
+          step * (rng() % 4 == 0 ? rng() % 500 : 20000 + rng() % 20000);
+      std::array<uint32_t, ASSET_VALUES.size()> assets{};
+      for (uint32_t& amount : assets) {
+        amount = static_cast<uint32_t>(rng() % 300);
+      }
+      reference.add_user(user_id, static_cast<uint32_t>(cash), assets);
+      for (Asset asset : ASSETS) {
+        exchanges[asset].register_user(user_id, static_cast<uint32_t>(cash),
+                                       assets[asset]);
+      }
+    }
+  }
+
+  auto fail(size_t step, const Op& op, const std::string& what) const -> bool {
+    std::cerr << "Mismatch in round with seed " << seed << " at op " << step
+              << " (" << describe(op) << "): " << what << '\n';
+    return false;
+  }
+
+  auto apply(size_t step, const Op& op, OpGenerator& generator) -> bool {
+    Book& exchange = exchanges[op.asset];
+    if (op.cancel) {
+      std::optional<std::string_view> actual =
+          exchange.cancel_order(op.order_id);
+      std::optional<std::string> expected =
+          reference.cancel_order(op.asset, op.order_id);
+      if (actual.has_value() != expected.has_value() ||
+          (actual.has_value() && actual.value() != expected.value())) {
+        return fail(step, op,
+                    "engine said " + std::string(actual.value_or("ok")) +
+                        ", reference said " + expected.value_or("ok"));
+      }
+      rejects += expected.has_value();
+      return true;
+    }
+
+    OrderResult actual =
+        exchange.place_order(op.side, op.user_id, op.price, op.volume);
+    ReferenceResult expected = reference.place_order(
+        op.asset, op.side, op.user_id, op.price, op.volume);
+    if (actual.error.has_value() != expected.error.has_value() ||
+        (actual.error.has_value() &&
+         actual.error.value() != expected.error.value())) {
+      return fail(step, op,
+                  "engine said " + std::string(actual.error.value_or("ok")) +
+                      ", reference said " + expected.error.value_or("ok"));
+    }
+    if (expected.error.has_value()) {
+      ++rejects;
+      return true;
+    }
+    if (actual.trades.size() != expected.trades.size()) {
+      return fail(step, op,
+                  "engine filled " + std::to_string(actual.trades.size()) +
+                      " times, reference " +
+                      std::to_string(expected.trades.size()));
+    }
+    for (size_t i = 0; i < expected.trades.size(); ++i) {
+      if (!same_trade(actual.trades[i], expected.trades[i])) {
+        return fail(step, op,
+                    "fill " + std::to_string(i) + " was " +
+                        describe(actual.trades[i]) + ", reference " +
+                        describe(expected.trades[i]));
+      }
+    }
+    fills += expected.trades.size();
+    if (actual.unmatched_order.has_value() != expected.resting.has_value() ||
+        (expected.resting.has_value() &&
+         !same_order(actual.unmatched_order.value(),
+                     expected.resting.value()))) {
+      return fail(step, op,
+                  "engine rested " + describe(actual.unmatched_order) +
+                      ", reference " + describe(expected.resting));
+    }
+    if (expected.resting.has_value()) {
+      generator.issued.emplace_back(op.asset, expected.resting->order_id);
+    }
+    return true;
+  }
+
+  auto check_state(size_t step, const Op& op) const -> bool {
+    for (const auto &[user_id, expected] : reference.users) {
+      const Cash& cash = ledger.user_cash.at(user_id);
+      if (cash.amount_held != expected.cash_held ||
+          cash.buying_power != expected.buying_power) {
+        return fail(step, op,
+                    "user " + std::to_string(user_id) + " cash " +
+                        std::to_string(cash.amount_held) + "/" +
+                        std::to_string(cash.buying_power) + ", reference " +
+                        std::to_string(expected.cash_held) + "/" +
+                        std::to_string(expected.buying_power));
+      }
+      for (Asset asset : ASSETS) {
+        const AssetAmount& assets = exchanges[asset].user_assets.at(user_id);
+        if (assets.amount_held != expected.assets_held[asset] ||
+            assets.selling_power != expected.selling_power[asset]) {
+          return fail(step, op,
+                      "user " + std::to_string(user_id) + " " +
+                          to_string(asset) + " " +
+                          std::to_string(assets.amount_held) + "/" +
+                          std::to_string(assets.selling_power) +
+                          ", reference " +
+                          std::to_string(expected.assets_held[asset]) + "/" +
+                          std::to_string(expected.selling_power[asset]));
+        }
+      }
+    }
+    for (Asset asset : ASSETS) {
+      std::vector<Order> actual = exchanges[asset].snapshot();
+      std::vector<Order> expected = reference.snapshot(asset);
+      bool same = actual.size() == expected.size();
+      for (size_t i = 0; same && i < actual.size(); ++i) {
+        same = same_order(actual[i], expected[i]);
+      }
+      if (!same) {
+        return fail(step, op, to_string(asset) + " book differs");
+      }
+    }
+    for (const std::string& violation : audit(exchanges)) {
+      return fail(step, op, "audit: " + violation);
+    }
+    return true;
+  }
+
+  auto run(bool adversarial) -> bool {
+    OpGenerator generator(seed, num_users, adversarial, Grid::MIN,
+                          Grid::MAX);
+    Op op{};
+    for (size_t step = 0; step < OPS_PER_ROUND; ++step) {
+      op = generator.next();
+      if (!apply(step, op, generator)) {
+        return false;
+      }
+      if (step % CHECK_EVERY == CHECK_EVERY - 1 && !check_state(step, op)) {
+        return false;
+      }
+    }
+    return check_state(OPS_PER_ROUND, op);
+  }
+};
+
+template <typename Book>
+auto fuzz(std::string_view name, uint64_t first_seed, uint64_t rounds)
+    -> bool {
+  size_t fills = 0;
+  size_t rejects = 0;
+  for (uint64_t seed = first_seed; seed < first_seed + rounds; ++seed) {
+    auto num_users = static_cast<uint32_t>(2 + seed % 7);
+    auto round = std::make_unique<Round<Book>>(seed, num_users);
+    if (!round->run(seed % 2 == 1)) {
+      return false;
+    }
+    fills += round->fills;
+    rejects += round->rejects;
+  }
+  std::cout << name << ": " << rounds << " rounds of " << OPS_PER_ROUND
+            << " ops agree, " << fills << " fills and " << rejects
+            << " rejects compared\n";
+  return true;
+}
+
+auto parse_arg(char* arg, uint64_t& value) -> bool {
+  std::string_view str(arg);
+  auto [ptr, ec] = std::from_chars(str.data(), str.data() + str.size(), value);
+  return ec == std::errc{} && ptr == str.data() + str.size();
+}
+
+auto main(int argc, char** argv) -> int {
+  uint64_t first_seed = 1;
+  uint64_t rounds = 200;
+  if ((argc > 1 && !parse_arg(argv[1], first_seed)) ||
+      (argc > 2 && !parse_arg(argv[2], rounds))) {
+    std::cerr << "Usage: fuzz [seed] [rounds]\n";
+    return 2;
+  }
+  // The production layout, then the sparse one over the same range so both
+  // grids face the same sequences, then the layout a range far past
+  // DENSE_GRID_LIMIT would get in production
+  using WideExchange = BasicExchange<PriceGrid<1, WIDE_MAX_PRICE>>;
+  static_assert(std::is_same_v<decltype(WideExchange::buy_orders),
+                               SparseGrid<1, WIDE_MAX_PRICE>>);
+  bool passed =
+      fuzz<Exchange>("dense grid", first_seed, rounds) &&
+      fuzz<BasicExchange<SparseGrid<MIN_PRICE, MAX_PRICE>>>(
+          "sparse grid", first_seed, rounds) &&
+      fuzz<WideExchange>("sparse grid [1, " + std::to_string(WIDE_MAX_PRICE) +
+                             "]",
+                         first_seed, rounds);
+  return passed ? 0 : 1;
+}
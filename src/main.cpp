@@ -1,415 +1,1452 @@
 #include <algorithm>
 #include <atomic>
+#include <charconv>
+#include <condition_variable>
 #include <cstdint>
 #include <cstdlib>
+#include <deque>
+#include <fstream>
 #include <iostream>
+#include <iterator>
+#include <latch>
+#include <limits>
 #include <memory>
+#include <pthread.h>
 #include <mutex>
+#include <span>
+#include <sstream>
 #include <string>
 #include <string_view>
+#include <sys/mman.h>
 #include <sys/types.h>
 #include <thread>
 #include <unistd.h>
 #include <unordered_map>
+#include <unordered_set>
 
 #include "App.h"
 #include "WebSocketProtocol.h"
 #include <glaze/glaze.hpp>
 
+#include "Config.hpp"
+#include "Deflate.hpp"
 #include "Exchange.hpp"
+#include "Game.hpp"
+#include "Json.hpp"
 #include "Models.hpp"
+#include "ShmFeed.hpp"
+#include "StaticFiles.hpp"
+#include "Trace.hpp"
+#include "TradeTape.hpp"
+#include "UserTable.hpp"
 #include "libusockets.h"
 
-// See
-// https://github.com/stephenberry/glaze?tab=readme-ov-file#explicit-metadata
-template <> struct glz::meta<Order> {
-  using T = Order;
-  // NOLINTNEXTLINE(readability-identifier-naming)
-  static constexpr auto value = object(&T::asset, &T::side, &T::user_id,
-                                       &T::price, &T::volume, &T::order_id);
+// Sent without touching glaze, so rejecting a flood costs next to nothing
+constexpr std::string_view RATE_LIMITED_PAYLOAD =
+    R"({"type":3,"error":"Rate limit exceeded."})";
+// Fixed errors are preformatted so the reject paths never serialize
+constexpr std::string_view MISSING_TYPE_PAYLOAD =
+    R"({"type":3,"error":"Message must have typed attached."})";
+constexpr std::string_view MISSING_REGISTER_FIELDS_PAYLOAD =
+    R"({"type":3,"error":"Must include user_id and username when registering."})";
+constexpr std::string_view MISSING_ORDER_FIELDS_PAYLOAD =
+    R"({"type":3,"error":"Must specify side, price, and volume when placing an order"})";
+constexpr std::string_view MISSING_ORDER_ID_PAYLOAD =
+    R"({"type":3,"error":"Must include order_id when canceling an order."})";
+constexpr std::string_view MISSING_LEGS_PAYLOAD =
+    R"({"type":3,"error":"Must specify legs when placing a basket"})";
+constexpr std::string_view MISSING_SEQ_PAYLOAD =
+    R"({"type":3,"error":"Must include seq when resuming."})";
+constexpr std::array<std::string_view, NUM_ASSETS> NOT_REGISTERED_PAYLOADS = {
+    R"({"type":3,"error":"Not registered on exchange dressing"})",
+    R"({"type":3,"error":"Not registered on exchange rye"})",
+    R"({"type":3,"error":"Not registered on exchange swiss"})",
+    R"({"type":3,"error":"Not registered on exchange pastrami"})",
 };
 
-constexpr uint32_t NUM_ASSETS = 4;
-constexpr std::string_view DEFAULT_TOPIC = "default";
+std::mutex cout_mutex;
+
+// Publishes everything for one asset in the seq order the exchange handed out
+// and keeps the most recent payloads so reconnecting clients can resume
+// instead of refetching state. Only touched from its asset's thread.
+struct MarketDataFeed {
+  static constexpr size_t PAYLOAD_RESERVE = 256;
+
+  uWS::SSLApp *app;
+  // <game>/<asset>, what the venue's sockets subscribe to
+  std::string topic;
+  // Same messages for clients on a /deflate path, with long frames sent
+  // compressed once for all of them
+  std::string deflate_topic;
+  size_t compress_threshold;
+  // Last seq published
+  uint64_t seq{0};
+  // Ring of payloads, the one published with seq s lives at s % size(). The
+  // strings are reused in place so a warm ring never allocates.
+  std::vector<std::string> replay;
+
+  MarketDataFeed(uWS::SSLApp *app, std::string topic, size_t replay_capacity,
+                 size_t compress_threshold)
+      : app(app),
+        topic(std::move(topic)),
+        deflate_topic(this->topic + "/deflate"),
+        compress_threshold(compress_threshold),
+        replay(replay_capacity) {
+    for (std::string &payload : replay) {
+      payload.reserve(PAYLOAD_RESERVE);
+    }
+  }
+
+  // outgoing.seq is set, and one past the last published
+  auto publish(OutgoingMessage &outgoing, uWS::OpCode op_code) -> void {
+    seq = outgoing.seq.value();
+    if (outgoing.times.has_value()) {
+      outgoing.times->published_ns = monotonic_ns();
+    }
+    TraceSpan write_span("write_json");
+    std::string_view payload = to_json(outgoing);
+    write_span.end();
+    TraceSpan publish_span("publish");
+    publish_all(payload, op_code);
+    publish_span.end();
+    if (!replay.empty()) {
+      replay[seq % replay.size()].assign(payload);
+    }
+  }
 
-const std::vector<uint32_t> STARTING_CASH = {30000, 30000, 30000, 27400};
-// const uint32_t STARTING_CASH = 10000;
-const std::vector<std::vector<uint32_t>> STARTING_ASSETS = {
-    {1000, 101, 66, 50}, // 16000
-    {200, 501, 66, 50},  // 16000
-    {201, 100, 333, 50},
-    {200, 101, 66, 250},
+  auto publish_all(std::string_view payload, uWS::OpCode op_code) -> void {
+    publish_deflated(app, topic, deflate_topic, compress_threshold, payload,
+                     op_code);
+  }
+
+  [[nodiscard]] auto topic_for(const SocketData &user_data) const
+      -> const std::string & {
+    return user_data.deflate ? deflate_topic : topic;
+  }
+
+  [[nodiscard]] auto oldest_seq() const -> uint64_t {
+    return seq < replay.size() ? 1 : seq - replay.size() + 1;
+  }
+
+  [[nodiscard]] auto replayed(uint64_t s) const -> std::string_view {
+    return replay[s % replay.size()];
+  }
 };
-std::atomic<uint8_t> next_assignment = DRESSING;
-std::mutex assignments_mutex;
-std::unordered_map<uint32_t, uint8_t> assignments;
-std::mutex cout_mutex;
-std::array<us_listen_socket_t *, 4> asset_sockets = {nullptr};
-us_listen_socket_t *api_socket = nullptr;
-bool accepting = false;
-
-auto handle_register_message(
-    Exchange &exchange, std::unordered_map<uint32_t, std::string> &usernames,
-    uWS::WebSocket<true, true, SocketData> *ws, const IncomingMessage &incoming,
-    uWS::OpCode op_code) -> void {
+
+// One exchange of one game, as served by the shard thread that owns it
+struct Venue {
+  Game &game;
+  Exchange &exchange;
+  uWS::Loop *loop;
+  MarketDataFeed feed;
+  Ticker published_ticker{};
+  // Each registered user's latest socket on this venue, for private updates
+  std::unordered_map<uint32_t, uWS::WebSocket<true, true, SocketData> *>
+      user_sockets{};
+  // Filled by the exchange under its book lock, from this thread or from a
+  // basket on another, and swapped out by push_positions
+  std::vector<uint32_t> changed_users{};
+  std::vector<uint32_t> pushing{};
+  // Filled and sequenced by the exchange under its book lock, from this
+  // thread or from a basket on another, and swapped out by flush
+  FeedOutbox outbox{};
+  FeedOutbox draining{};
+
+  // Publishes what the book sequenced since the last flush, in seq order,
+  // then the positions it changed
+  auto flush() -> void {
+    {
+      std::scoped_lock lock(exchange.book_mutex());
+      outbox.take(draining);
+    }
+    for (const OutboxEvent &event : draining.events) {
+      OutgoingMessage outgoing{};
+      outgoing.type = event.type;
+      outgoing.seq = event.seq;
+      if (event.type == CANCEL) {
+        outgoing.order_id = event.order_id;
+      } else {
+        std::span<const Trade> fills = draining.fills(event);
+        if (!fills.empty()) {
+          outgoing.trades = fills;
+        }
+        outgoing.unmatched_order = event.unmatched_order;
+      }
+      outgoing.times = {.received_ns = event.received_ns,
+                        .matched_ns = event.matched_ns,
+                        .published_ns = 0};
+      feed.publish(outgoing, uWS::OpCode::TEXT);
+    }
+    draining.clear();
+    push_positions();
+  }
+
+  // Tickers are unsequenced, a client that misses one just waits for the next
+  auto publish_ticker() -> void {
+    Ticker ticker = exchange.ticker();
+    if (ticker == published_ticker) {
+      return;
+    }
+    published_ticker = ticker;
+    OutgoingMessage outgoing{};
+    outgoing.type = TICKER;
+    outgoing.ticker = ticker;
+    feed.publish_all(to_json(outgoing), uWS::OpCode::TEXT);
+  }
+
+  // Sends every user whose cash, assets or orders changed since the last
+  // push their position on this book, if they're connected here, so clients
+  // never have to poll get_state
+  auto push_positions() -> void {
+    {
+      std::scoped_lock lock(exchange.book_mutex());
+      pushing.swap(changed_users);
+    }
+    std::ranges::sort(pushing);
+    auto duplicates = std::ranges::unique(pushing);
+    pushing.erase(duplicates.begin(), duplicates.end());
+    for (uint32_t user_id : pushing) {
+      auto socket = user_sockets.find(user_id);
+      if (socket == user_sockets.end()) {
+        continue;
+      }
+      OutgoingMessage outgoing{};
+      outgoing.type = POSITION;
+      outgoing.position = position(user_id);
+      socket->second->send(to_json(outgoing), uWS::OpCode::TEXT);
+    }
+    pushing.clear();
+  }
+
+  // The version is read in the same critical section as the balances it
+  // labels, and only this book's lock is taken
+  [[nodiscard]] auto position(uint32_t user_id) const -> Position {
+    std::scoped_lock lock(exchange.book_mutex(), game.ledger.cash_mutex);
+    const Cash &cash = game.ledger.user_cash.at(user_id);
+    const AssetAmount &assets = exchange.user_assets.at(user_id);
+    return {.version = game.ledger.state_versions.at(user_id),
+            .asset = exchange.asset,
+            .cash = cash.amount_held,
+            .buying_power = cash.buying_power,
+            .assets_held = assets.amount_held,
+            .selling_power = assets.selling_power};
+  }
+};
+
+// The seq comes from the same book lock as the orders, so a client drops
+// exactly the published events the snapshot already reflects
+auto send_snapshot(const Venue &venue,
+                   uWS::WebSocket<true, true, SocketData> *ws,
+                   uWS::OpCode op_code) -> void {
+  OutgoingMessage outgoing{};
+  outgoing.type = SNAPSHOT;
+  auto [orders, seq] = venue.exchange.sequenced_snapshot();
+  outgoing.orders = std::move(orders);
+  outgoing.seq = seq;
+  send_deflated(ws, ws->getUserData()->deflate, venue.feed.compress_threshold,
+                to_json(outgoing), op_code);
+}
+
+auto handle_register_message(Venue &venue,
+                             uWS::WebSocket<true, true, SocketData> *ws,
+                             const IncomingMessage &incoming,
+                             uWS::OpCode op_code) -> void {
   if (ws->getUserData()->registered) {
     return;
   }
-  OutgoingMessage outgoing{};
   if (!incoming.user_id.has_value() || !incoming.username.has_value()) {
-    outgoing.type = ERROR;
-    outgoing.error = "Must include user_id and username when registering.";
-    ws->send(glz::write_json(outgoing).value_or("Error encoding JSON."),
-             op_code);
+    ws->send(MISSING_REGISTER_FIELDS_PAYLOAD, op_code);
     return;
   }
 
-  {
-    std::scoped_lock lock(assignments_mutex);
-    if (!assignments.contains(incoming.user_id.value())) {
-      assignments[incoming.user_id.value()] = next_assignment;
-      next_assignment = (next_assignment + 1) % 4;
-    }
-  }
-
-  exchange.register_user(
-      incoming.user_id.value(),
-      STARTING_CASH[assignments[incoming.user_id.value()]],
-      STARTING_ASSETS[assignments[incoming.user_id.value()]][exchange.asset]);
-  usernames[incoming.user_id.value()] = incoming.username.value();
+  OutgoingMessage outgoing{};
+  venue.game.register_user(venue.exchange.asset, incoming.user_id.value(),
+                           incoming.username.value());
 
   ws->getUserData()->user_id = incoming.user_id.value();
   ws->getUserData()->registered = true;
+  venue.user_sockets[incoming.user_id.value()] = ws;
   outgoing.type = REGISTER;
   outgoing.user_id = incoming.user_id;
   outgoing.username = incoming.username.value();
-  ws->send(glz::write_json(outgoing).value_or("Error encoding JSON."), op_code);
+  ws->send(to_json(outgoing), op_code);
 }
 
-auto handle_cancel_message(Exchange &exchange, uWS::SSLApp *app,
+auto handle_cancel_message(Venue &venue,
                            uWS::WebSocket<true, true, SocketData> *ws,
                            const IncomingMessage &incoming,
-                           uWS::OpCode op_code) -> void {
-  if (!accepting) {
+                           uWS::OpCode op_code, int64_t received_ns) -> void {
+  if (!venue.game.accepting) {
     return;
   }
-  OutgoingMessage outgoing{};
   if (!incoming.order_id.has_value()) {
-    outgoing.type = ERROR;
-    outgoing.error = "Must include order_id when canceling an order.";
-    ws->send(glz::write_json(outgoing).value_or("Error encoding JSON."),
-             op_code);
+    ws->send(MISSING_ORDER_ID_PAYLOAD, op_code);
     return;
   }
-  std::optional<std::string> error =
-      exchange.cancel_order(incoming.order_id.value());
-  outgoing.order_id = incoming.order_id;
+  std::optional<std::string_view> error =
+      venue.exchange.cancel_order(incoming.order_id.value(), received_ns);
   if (error.has_value()) {
+    OutgoingMessage outgoing{};
     outgoing.type = ERROR;
+    outgoing.order_id = incoming.order_id;
     outgoing.error = error.value();
-    ws->send(glz::write_json(outgoing).value_or("Error encoding JSON."),
-             op_code);
-    return;
+    ws->send(to_json(outgoing), op_code);
   }
-  outgoing.type = CANCEL;
-  app->publish(DEFAULT_TOPIC,
-               glz::write_json(outgoing).value_or("Error encoding JSON."),
-               op_code);
 }
 
-auto handle_order_message(Exchange &exchange, uWS::SSLApp *app,
+auto handle_order_message(Venue &venue,
                           uWS::WebSocket<true, true, SocketData> *ws,
                           const IncomingMessage &incoming,
-                          uWS::OpCode op_code) -> void {
-  if (!accepting) {
+                          uWS::OpCode op_code, int64_t received_ns) -> void {
+  if (!venue.game.accepting) {
     return;
   }
-  OutgoingMessage outgoing{};
   SocketData *user_data = ws->getUserData();
   if (!user_data->registered) {
-    outgoing.type = ERROR;
-    outgoing.error =
-        "Not registered on exchange" + to_string_lower(exchange.asset);
-    ws->send(glz::write_json(outgoing).value_or("Error encoding JSON."),
-             op_code);
+    ws->send(NOT_REGISTERED_PAYLOADS[venue.exchange.asset], op_code);
     return;
   }
 
   if (!incoming.side.has_value() || !incoming.price.has_value() ||
       !incoming.volume.has_value()) {
-    outgoing.type = ERROR;
-    outgoing.error =
-        "Must specify side, price, and volume when placing an order";
-    ws->send(glz::write_json(outgoing).value_or("Error encoding JSON."),
-             op_code);
+    ws->send(MISSING_ORDER_FIELDS_PAYLOAD, op_code);
     return;
   }
 
-  OrderResult order_result =
-      exchange.place_order(incoming.side.value(), user_data->user_id,
-                           incoming.price.value(), incoming.volume.value());
+  OrderResult order_result = venue.exchange.place_order(
+      incoming.side.value(), user_data->user_id, incoming.price.value(),
+      incoming.volume.value(), received_ns);
   if (order_result.error.has_value()) {
+    OutgoingMessage outgoing{};
     outgoing.type = ERROR;
     outgoing.error = order_result.error.value();
-    ws->send(glz::write_json(outgoing).value_or("Error encoding JSON."),
-             op_code);
+    ws->send(to_json(outgoing), op_code);
+  }
+}
+
+auto handle_basket_message(Venue &venue,
+                           uWS::WebSocket<true, true, SocketData> *ws,
+                           const IncomingMessage &incoming,
+                           uWS::OpCode op_code, int64_t received_ns) -> void {
+  if (!venue.game.accepting) {
+    return;
+  }
+  SocketData *user_data = ws->getUserData();
+  if (!user_data->registered) {
+    ws->send(NOT_REGISTERED_PAYLOADS[venue.exchange.asset], op_code);
+    return;
+  }
+
+  if (!incoming.legs.has_value()) {
+    ws->send(MISSING_LEGS_PAYLOAD, op_code);
+    return;
+  }
+
+  OutgoingMessage outgoing{};
+
+  const std::vector<BasketLeg> &legs = incoming.legs.value();
+  BasketResult basket_result = Exchange::place_basket(
+      venue.game.exchanges, user_data->user_id, legs, received_ns);
+  ServerTimes times{.received_ns = received_ns,
+                    .matched_ns = monotonic_ns(),
+                    .published_ns = 0};
+  if (basket_result.error.has_value()) {
+    outgoing.type = ERROR;
+    outgoing.error = basket_result.error.value();
+    ws->send(to_json(outgoing), op_code);
     return;
   }
-  outgoing.type = ORDER;
-  outgoing.trades = std::move(order_result.trades);
-  outgoing.unmatched_order = order_result.unmatched_order;
 
-  app->publish(DEFAULT_TOPIC,
-               glz::write_json(outgoing).value_or("Error encoding JSON."),
-               op_code);
+  // Each book already sequenced its leg as an ordinary order message, the
+  // other books' threads only need waking to publish theirs
+  for (const BasketLeg &leg : legs) {
+    if (leg.asset != venue.exchange.asset) {
+      venue.game.exchanges[leg.asset].outbox->notify();
+    }
+  }
+
+  outgoing.type = BASKET;
+  outgoing.basket_trades = std::move(basket_result.trades);
+  times.published_ns = monotonic_ns();
+  outgoing.times = times;
+  ws->send(to_json(outgoing), op_code);
 }
 
-auto run_asset_socket(Asset asset, Exchange &exchange,
-                      std::unordered_map<uint32_t, std::string> &usernames) {
-  auto *app = new uWS::SSLApp();
+// Answered straight away with the server's clock. Halving the round trip
+// gives the client the offset between its clock and ours, and with it the
+// one-way latency of every timestamped message.
+auto handle_ping_message(uWS::WebSocket<true, true, SocketData> *ws,
+                         const IncomingMessage &incoming,
+                         uWS::OpCode op_code) -> void {
+  OutgoingMessage outgoing{};
+  outgoing.type = PING;
+  outgoing.client_time = incoming.client_time;
+  outgoing.server_ns = monotonic_ns();
+  ws->send(to_json(outgoing), op_code);
+}
 
-  auto on_open = [](uWS::WebSocket<true, true, SocketData> *ws) {
-    ws->subscribe(DEFAULT_TOPIC);
+// Replays everything after incoming.seq, or sends a snapshot when the
+// replay buffer no longer reaches back that far. Publishes whatever the book
+// already sequenced first, since a snapshot's seq can be ahead of the feed.
+auto handle_resume_message(Venue &venue,
+                           uWS::WebSocket<true, true, SocketData> *ws,
+                           const IncomingMessage &incoming,
+                           uWS::OpCode op_code) -> void {
+  if (!incoming.seq.has_value()) {
+    ws->send(MISSING_SEQ_PAYLOAD, op_code);
+    return;
+  }
+  venue.flush();
+  const MarketDataFeed &feed = venue.feed;
+  uint64_t since = incoming.seq.value();
+  if (since > feed.seq || since + 1 < feed.oldest_seq()) {
+    send_snapshot(venue, ws, op_code);
+    return;
+  }
+  for (uint64_t s = since + 1; s <= feed.seq; ++s) {
+    send_deflated(ws, ws->getUserData()->deflate, feed.compress_threshold,
+                  feed.replayed(s), op_code);
+  }
+}
+
+// Tracks every socket on one shard thread so a periodic timer can pull
+// subscribers that stop reading off their topic before their buffers balloon.
+struct BackpressureMonitor {
+  uint32_t soft_limit;
+  std::unordered_map<uWS::WebSocket<true, true, SocketData> *, Venue *>
+      sockets;
+
+  auto check() -> void {
+    for (auto [ws, venue] : sockets) {
+      SocketData *user_data = ws->getUserData();
+      if (!user_data->lagging && ws->getBufferedAmount() > soft_limit) {
+        ws->unsubscribe(venue->feed.topic_for(*user_data));
+        user_data->lagging = true;
+      }
+    }
+  }
+
+  // Lagging sockets skip every missed event and get the current book instead
+  auto on_drain(uWS::WebSocket<true, true, SocketData> *ws) -> void {
+    SocketData *user_data = ws->getUserData();
+    if (!user_data->lagging || ws->getBufferedAmount() > soft_limit / 2) {
+      return;
+    }
+    Venue *venue = sockets.at(ws);
+    send_snapshot(*venue, ws, uWS::OpCode::TEXT);
+    ws->subscribe(venue->feed.topic_for(*user_data));
+    user_data->lagging = false;
+  }
+};
+
+auto serve_venue(uWS::SSLApp *app, Venue &venue, BackpressureMonitor &monitor,
+                 const Config &config) -> std::vector<std::string> {
+  auto on_open = [&monitor,
+                  &venue](uWS::WebSocket<true, true, SocketData> *ws) {
+    monitor.sockets[ws] = &venue;
+    ws->subscribe(venue.feed.topic);
+  };
+
+  auto on_open_deflate = [&monitor,
+                          &venue](uWS::WebSocket<true, true, SocketData> *ws) {
+    monitor.sockets[ws] = &venue;
+    ws->getUserData()->deflate = true;
+    ws->subscribe(venue.feed.deflate_topic);
+  };
+
+  auto on_drain = [&monitor](uWS::WebSocket<true, true, SocketData> *ws) {
+    monitor.on_drain(ws);
   };
 
-  auto on_message = [&app, &exchange, &usernames](
+  auto on_close = [&monitor, &venue](
+                      uWS::WebSocket<true, true, SocketData> *ws,
+                      int /*code*/, std::string_view /*message*/) {
+    monitor.sockets.erase(ws);
+    SocketData *user_data = ws->getUserData();
+    auto socket = venue.user_sockets.find(user_data->user_id);
+    if (user_data->registered && socket != venue.user_sockets.end() &&
+        socket->second == ws) {
+      venue.user_sockets.erase(socket);
+    }
+  };
+
+  auto on_message = [&venue, &config](
                         uWS::WebSocket<true, true, SocketData> *ws,
                         std::string_view message, uWS::OpCode op_code) {
+    int64_t received_ns = monotonic_ns();
+    if (!ws->getUserData()->rate_limit.try_consume(
+            config.messages_per_second, config.message_burst,
+            std::chrono::steady_clock::now())) {
+      ws->send(RATE_LIMITED_PAYLOAD, op_code);
+      return;
+    }
+
+    TraceRoot trace("on_message");
+    TraceSpan read_span("read_json");
     IncomingMessage incoming{};
     glz::error_ctx ec = glz::read_json(incoming, message);
+    read_span.end();
 
     if (ec) {
+      std::string error = glz::format_error(ec, message);
       OutgoingMessage outgoing{};
       outgoing.type = ERROR;
-      outgoing.error = glz::format_error(ec, message);
-      ws->send(glz::write_json(outgoing).value_or("Error encoding JSON."),
-               op_code);
+      outgoing.error = error;
+      ws->send(to_json(outgoing), op_code);
       return;
     }
 
     if (!incoming.type.has_value()) {
-      OutgoingMessage outgoing{};
-      outgoing.type = ERROR;
-      outgoing.error = "Message must have typed attached.";
-      ws->send(glz::write_json(outgoing).value_or("Error encoding JSON."),
-               op_code);
+      ws->send(MISSING_TYPE_PAYLOAD, op_code);
       return;
     }
 
     switch (incoming.type.value()) {
     case REGISTER:
-      handle_register_message(exchange, usernames, ws, incoming, op_code);
+      handle_register_message(venue, ws, incoming, op_code);
       break;
     case ORDER:
-      handle_order_message(exchange, app, ws, incoming, op_code);
+      handle_order_message(venue, ws, incoming, op_code, received_ns);
       break;
     case CANCEL:
-      handle_cancel_message(exchange, app, ws, incoming, op_code);
+      handle_cancel_message(venue, ws, incoming, op_code, received_ns);
+      break;
+    case BASKET:
+      handle_basket_message(venue, ws, incoming, op_code, received_ns);
+      break;
+    case RESUME:
+      handle_resume_message(venue, ws, incoming, op_code);
+      break;
+    case PING:
+      handle_ping_message(ws, incoming, op_code);
+      break;
+    // A fresh start, e.g. for a relay that lost its place
+    case SNAPSHOT:
+      send_snapshot(venue, ws, op_code);
       break;
     case ERROR:
+    case TICKER:
+    case POSITION:
       break;
     }
+    venue.flush();
 
-    // std::cout << exchange << '\n';
+    // std::cout << venue.exchange << '\n';
   };
 
-  app->ws<SocketData>("/asset/" + to_string_lower(asset),
-                      {
-                          .idleTimeout = 10,
-                          .open = on_open,
-                          .message = on_message,
-                      })
-      .listen(9001 + asset, [asset](auto *listen_s) {
-        if (listen_s) {
-          asset_sockets[asset] = listen_s;
-          // std::lock_guard lg(cout_mutex);
-          // std::cout << "Listening on port " << 9001 + asset << '\n';
+  std::vector<std::string> paths = {
+      "/game/" + std::to_string(venue.game.id) + "/asset/" +
+      to_string_lower(venue.exchange.asset)};
+  // Clients from before multi-game hosting only know about game 0
+  if (venue.game.id == 0) {
+    paths.push_back("/asset/" + to_string_lower(venue.exchange.asset));
+  }
+  for (const std::string &path : paths) {
+    app->ws<SocketData>(path,
+                        {
+                            .idleTimeout = 10,
+                            .maxBackpressure = config.backpressure_hard_limit,
+                            .closeOnBackpressureLimit = true,
+                            .open = on_open,
+                            .message = on_message,
+                            .drain = on_drain,
+                            .close = on_close,
+                        });
+    app->ws<SocketData>(path + "/deflate",
+                        {
+                            .idleTimeout = 10,
+                            .maxBackpressure = config.backpressure_hard_limit,
+                            .closeOnBackpressureLimit = true,
+                            .open = on_open_deflate,
+                            .message = on_message,
+                            .drain = on_drain,
+                            .close = on_close,
+                        });
+  }
+  return paths;
+}
+
+// Pins the calling thread, a no-op where affinity isn't supported
+auto pin_to_core(int core) -> bool {
+#ifdef __linux__
+  cpu_set_t cpu_set;
+  CPU_ZERO(&cpu_set);
+  CPU_SET(static_cast<size_t>(core), &cpu_set);
+  return pthread_setaffinity_np(pthread_self(), sizeof(cpu_set), &cpu_set) ==
+         0;
+#else
+  (void)core;
+  return false;
+#endif
+}
+
+// Keeps a loop spinning instead of sleeping in epoll_wait, waking it after
+// every iteration makes the next wait return straight away. uSockets always
+// waits with an infinite timeout, so this is the only way in: each spin costs
+// an eventfd write, an epoll_wait that returns at once and an eventfd read,
+// three syscalls, and the thread never leaves its core. What it buys is that
+// a message never waits on the scheduler to wake a sleeping thread.
+auto busy_poll(uWS::Loop *loop) -> void {
+  loop->addPostHandler(loop, [](uWS::Loop *spinning) {
+    us_wakeup_loop(reinterpret_cast<us_loop_t *>(spinning));
+  });
+}
+
+auto describe_core(std::optional<int> core, bool pinned) -> std::string {
+  if (!core.has_value()) {
+    return "any core";
+  }
+  if (!pinned) {
+    return "any core (pinning to " + std::to_string(core.value()) +
+           " failed)";
+  }
+  return "core " + std::to_string(core.value());
+}
+
+struct MemoryFootprint {
+  size_t resident;
+  size_t huge_pages;
+};
+
+// From the kernel's totals for the whole process, zeros where there's no
+// /proc
+auto memory_footprint() -> MemoryFootprint {
+  MemoryFootprint footprint{.resident = 0, .huge_pages = 0};
+  std::ifstream rollup("/proc/self/smaps_rollup");
+  std::string line;
+  while (std::getline(rollup, line)) {
+    std::istringstream fields(line);
+    std::string field;
+    size_t kb = 0;
+    if (!(fields >> field >> kb)) {
+      continue;
+    }
+    if (field == "Rss:") {
+      footprint.resident = kb * 1024;
+    } else if (field == "AnonHugePages:") {
+      footprint.huge_pages = kb * 1024;
+    }
+  }
+  return footprint;
+}
+
+// A thread with its own uWS loop serving some set of venues, each on its own
+// app and port so the layout doesn't depend on how many threads there are
+struct Shard {
+  size_t index;
+  std::optional<int> core;
+  bool pinned{false};
+  std::vector<std::pair<Game *, Asset>> assigned;
+  uWS::Loop *loop{nullptr};
+  BackpressureMonitor *monitor{nullptr};
+  std::vector<us_listen_socket_t *> listen_sockets;
+  std::thread thread;
+
+  auto run(const Config &config, std::latch &ready) -> void {
+    pinned = core.has_value() && pin_to_core(core.value());
+    name_trace_thread("shard " + std::to_string(index));
+    // One per venue on this thread's loop, so a port only routes its own
+    // venue's paths. deque so apps stay put as more are added.
+    std::deque<uWS::SSLApp> apps;
+    loop = uWS::Loop::get();
+    if (config.busy_poll) {
+      busy_poll(loop);
+    }
+
+    BackpressureMonitor backpressure{.soft_limit =
+                                         config.backpressure_soft_limit,
+                                     .sockets = {}};
+    monitor = &backpressure;
+    // A socket per player on each of this shard's venues
+    backpressure.sockets.reserve(config.expected_users * assigned.size());
+    // fallthrough so the timer doesn't keep the loop alive after listen
+    // sockets close
+    us_timer_t *backpressure_timer = us_create_timer(
+        reinterpret_cast<us_loop_t *>(loop), 1, sizeof(BackpressureMonitor *));
+    *static_cast<BackpressureMonitor **>(us_timer_ext(backpressure_timer)) =
+        &backpressure;
+    us_timer_set(
+        backpressure_timer,
+        [](us_timer_t *timer) {
+          (*static_cast<BackpressureMonitor **>(us_timer_ext(timer)))->check();
+        },
+        static_cast<int>(config.backpressure_check_ms),
+        static_cast<int>(config.backpressure_check_ms));
+
+    // deque so venue addresses stay put as more are added
+    std::deque<Venue> shard_venues;
+    us_timer_t *ticker_timer = us_create_timer(
+        reinterpret_cast<us_loop_t *>(loop), 1, sizeof(std::deque<Venue> *));
+    *static_cast<std::deque<Venue> **>(us_timer_ext(ticker_timer)) =
+        &shard_venues;
+    us_timer_set(
+        ticker_timer,
+        [](us_timer_t *timer) {
+          for (Venue &venue :
+               **static_cast<std::deque<Venue> **>(us_timer_ext(timer))) {
+            venue.publish_ticker();
+          }
+        },
+        static_cast<int>(config.ticker_interval_ms),
+        static_cast<int>(config.ticker_interval_ms));
+    for (auto [game, asset] : assigned) {
+      uWS::SSLApp &app = apps.emplace_back();
+      Venue &venue = shard_venues.emplace_back(
+          *game, game->exchanges[asset], loop,
+          MarketDataFeed(&app,
+                         std::to_string(game->id) + "/" +
+                             to_string_lower(asset),
+                         config.replay_buffer_size, config.compress_threshold));
+      venue.user_sockets.reserve(config.expected_users);
+      venue.outbox.notify = [&venue]() {
+        venue.loop->defer([&venue]() { venue.flush(); });
+      };
+      game->exchanges[asset].changed_users = &venue.changed_users;
+      game->exchanges[asset].outbox = &venue.outbox;
+      std::vector<std::string> paths =
+          serve_venue(&app, venue, backpressure, config);
+      int port = config.venue_port(game->id, asset);
+      app.listen(port, [this, port, &paths](auto *listen_s) {
+        std::lock_guard lg(cout_mutex);
+        if (!listen_s) {
+          std::cout << "Failed to listen on port " << port << '\n';
+          return;
+        }
+        listen_sockets.push_back(listen_s);
+        for (const std::string &path : paths) {
+          std::cout << "Serving " << path << " on port " << port << '\n';
         }
       });
+    }
+    ready.count_down();
 
-  app->run();
+    // Every app shares the loop, running one runs them all
+    apps.front().run();
 
-  delete app;
+    us_timer_close(ticker_timer);
+    us_timer_close(backpressure_timer);
+    apps.clear();
 
-  uWS::Loop::get()->free();
+    uWS::Loop::get()->free();
+  }
+
+  // Called from another thread, stops accepting and drops every client so
+  // the loop can exit
+  auto stop() -> void {
+    loop->defer([this]() {
+      for (us_listen_socket_t *listen_socket : listen_sockets) {
+        us_listen_socket_close(1, listen_socket);
+      }
+      listen_sockets.clear();
+      std::vector<uWS::WebSocket<true, true, SocketData> *> sockets;
+      for (auto [ws, _] : monitor->sockets) {
+        sockets.push_back(ws);
+      }
+      for (auto *ws : sockets) {
+        ws->close();
+      }
+    });
+  }
+};
+
+auto find_game(const std::vector<std::unique_ptr<Game>> &games,
+               std::string_view game_id) -> Game * {
+  uint32_t id = 0;
+  auto [ptr, ec] =
+      std::from_chars(game_id.data(), game_id.data() + game_id.size(), id);
+  if (ec != std::errc{} || ptr != game_id.data() + game_id.size() ||
+      id >= games.size()) {
+    return nullptr;
+  }
+  return games[id].get();
 }
 
-auto handle_state_request(const std::vector<Exchange> &exchanges) {
-  return [&exchanges](uWS::HttpResponse<true> *res,
-                      uWS::HttpRequest *req) -> void {
+// Tagged with the user's state version and the books' version, so a client
+// that already has this state gets a 304 without it being rebuilt. Clients
+// on the WebSocket feeds only need this once, positions are pushed to them.
+auto handle_state_request(const std::vector<std::unique_ptr<Game>> &games) {
+  return [&games](uWS::HttpResponse<true> *res,
+                  uWS::HttpRequest *req) -> void {
     GameState state;
-    if (req->getHeader("user-id").empty()) {
+    // Routes without a :game parameter are the legacy single-game ones
+    Game *game = find_game(
+        games, req->getParameter(0).empty() ? "0" : req->getParameter(0));
+    if (game == nullptr) {
+      state.error = "game not found";
+      res->end(to_json(state));
+      return;
+    }
+    std::string_view user_header = req->getHeader("user-id");
+    if (user_header.empty()) {
       state.error = "user_id not set";
-      res->end(glz::write_json(state).value_or("Error encoding JSON."));
+      res->end(to_json(state));
       return;
     }
-    uint32_t user_id =
-        static_cast<uint32_t>(std::stoul(req->getHeader("user-id").data()));
-    std::unordered_map<uint32_t, std::deque<Order>::iterator> order_iters;
-    for (const auto &exchange : exchanges) {
-      if (!exchange.user_assets.contains(user_id)) {
-        state.error = "User with user_id: " + std::to_string(user_id) +
-                      " not registered on exchange " +
-                      to_string(exchange.asset);
-        res->end(glz::write_json(state).value_or("Error encoding JSON."));
-        return;
+    uint32_t user_id = 0;
+    auto [ptr, ec] = std::from_chars(
+        user_header.data(), user_header.data() + user_header.size(), user_id);
+    if (ec != std::errc{} || ptr != user_header.data() + user_header.size()) {
+      state.error = "user_id must be a number";
+      res->end(to_json(state));
+      return;
+    }
+    // Read before the state so the state is never older than its tag
+    std::optional<uint64_t> version = game->state_version(user_id);
+    if (!version.has_value()) {
+      for (const auto &exchange : game->exchanges) {
+        std::scoped_lock lock(exchange.book_mutex());
+        if (!exchange.user_assets.contains(user_id)) {
+          state.error = "User with user_id: " + std::to_string(user_id) +
+                        " not registered on exchange " +
+                        to_string(exchange.asset);
+          break;
+        }
       }
+      res->end(to_json(state));
+      return;
     }
-    state.cash = Exchange::user_cash.at(user_id).amount_held;
-    state.buying_power = Exchange::user_cash.at(user_id).buying_power;
-    for (const auto &exchange : exchanges) {
+    // Only the user's own state is in the body, so only their version is in
+    // the tag and other players' orders don't invalidate it
+    std::string etag = "\"" + std::to_string(user_id) + "-" +
+                       std::to_string(version.value()) + "\"";
+    if (req->getHeader("if-none-match").find(etag) != std::string_view::npos) {
+      res->writeStatus("304 Not Modified");
+      res->writeHeader("ETag", etag);
+      res->writeHeader("Vary", "User-Id");
+      res->end();
+      return;
+    }
+
+    state.version = version.value();
+    {
+      std::scoped_lock lock(game->ledger.cash_mutex);
+      state.cash = game->ledger.user_cash.at(user_id).amount_held;
+      state.buying_power = game->ledger.user_cash.at(user_id).buying_power;
+    }
+    for (const auto &exchange : game->exchanges) {
+      std::scoped_lock lock(exchange.book_mutex());
       for (auto [order_id, order_iter] : exchange.all_orders) {
-        state.orders.emplace(order_id, *order_iter);
+        if (order_iter->user_id == user_id) {
+          state.orders.emplace(order_id, *order_iter);
+        }
       }
       state.assets_held.push_back(exchange.user_assets.at(user_id).amount_held);
       state.selling_power.push_back(
           exchange.user_assets.at(user_id).selling_power);
     }
-    res->end(glz::write_json(state).value_or("Error encoding JSON."));
+    res->writeHeader("ETag", etag);
+    res->writeHeader("Cache-Control", "no-cache");
+    res->writeHeader("Vary", "User-Id");
+    res->end(to_json(state));
   };
 };
 
-auto get_portfolio_value(const std::vector<Exchange> &exchanges,
-                         uint32_t user_id) -> uint32_t {
-  if (!Exchange::user_cash.contains(user_id)) {
-    return 0;
-  }
-  uint32_t portfolio_value = Exchange::user_cash.at(user_id).amount_held;
-  std::optional<uint32_t> ruebens = {};
-  for (const auto &exchange : exchanges) {
-    if (exchange.user_assets.contains(user_id)) {
-      portfolio_value +=
-          exchange.user_assets.at(user_id).amount_held * value(exchange.asset);
-      if (ruebens.has_value()) {
-        ruebens = std::min(ruebens.value(),
-                           exchange.user_assets.at(user_id).amount_held);
-      } else {
-        ruebens = exchange.user_assets.at(user_id).amount_held;
+auto handle_leaderboard_request(
+    const std::vector<std::unique_ptr<Game>> &games) {
+  return [&games](uWS::HttpResponse<true> *res,
+                  uWS::HttpRequest *req) -> void {
+    Game *game = find_game(
+        games, req->getParameter(0).empty() ? "0" : req->getParameter(0));
+    std::unordered_map<std::string, uint32_t> leaderboard;
+    if (game == nullptr) {
+      res->end(to_json(leaderboard));
+      return;
+    }
+    for (auto &[portfolio_value, username] : game->leaderboard()) {
+      leaderboard[username] = portfolio_value;
+    }
+    res->end(to_json(leaderboard));
+  };
+}
+
+// Ticker and candles for every book of a game, enough to draw its charts
+auto handle_market_request(const std::vector<std::unique_ptr<Game>> &games) {
+  return [&games](uWS::HttpResponse<true> *res,
+                  uWS::HttpRequest *req) -> void {
+    Game *game = find_game(
+        games, req->getParameter(0).empty() ? "0" : req->getParameter(0));
+    std::unordered_map<std::string, MarketSummary> market;
+    if (game == nullptr) {
+      res->end(to_json(market));
+      return;
+    }
+    for (const auto &exchange : game->exchanges) {
+      market[to_string_lower(exchange.asset)] = exchange.market_summary();
+    }
+    res->end(to_json(market));
+  };
+}
+
+struct ChromeTraceArgs {
+  std::optional<uint64_t> trace_id;
+  std::optional<std::string_view> name;
+};
+
+// One entry of Chrome's Trace Event Format, only complete (X) and metadata (M)
+// events are emitted
+struct ChromeTraceEvent {
+  std::string_view name;
+  std::string_view ph;
+  double ts;
+  std::optional<double> dur;
+  uint32_t pid;
+  uint32_t tid;
+  ChromeTraceArgs args;
+};
+
+// Every sampled span still in the per-thread buffers, in Chrome's trace event
+// format so it loads straight into chrome://tracing or Perfetto
+auto handle_trace_request() {
+  return [](uWS::HttpResponse<true> *res, uWS::HttpRequest * /*req*/) -> void {
+    auto collected = Tracer::instance().collect();
+    const TscClock &clock = TscClock::get();
+    std::vector<ChromeTraceEvent> events;
+    for (const auto &[buffer, records] : collected) {
+      events.push_back({.name = "thread_name",
+                        .ph = "M",
+                        .ts = 0,
+                        .dur = {},
+                        .pid = 1,
+                        .tid = buffer->thread_id,
+                        .args = {.trace_id = {}, .name = buffer->thread_name}});
+      for (const TraceRecord &record : records) {
+        events.push_back({.name = record.name,
+                          .ph = "X",
+                          .ts = clock.to_us(record.start),
+                          .dur = clock.to_us(record.end) -
+                                 clock.to_us(record.start),
+                          .pid = 1,
+                          .tid = buffer->thread_id,
+                          .args = {.trace_id = record.trace_id, .name = {}}});
       }
     }
+    res->writeHeader("Content-Type", "application/json");
+    res->end(to_json(events));
+  };
+}
+
+// Leaves value alone when the parameter is missing, false if it's malformed
+template <typename T>
+auto query_number(uWS::HttpRequest *req, std::string_view key, T &value)
+    -> bool {
+  std::string_view raw = req->getQuery(key);
+  if (raw.empty()) {
+    return true;
   }
+  auto [ptr, ec] = std::from_chars(raw.data(), raw.data() + raw.size(), value);
+  return ec == std::errc{} && ptr == raw.data() + raw.size();
+}
 
-  if (ruebens.has_value()) {
-    portfolio_value += ruebens.value() * RUEBEN_VALUE;
+// One /api/trades response. Blocks are decoded and written one at a time
+// until the socket pushes back, then again each time it drains, so a long
+// range is never decoded up front or buffered whole.
+struct TradeStream {
+  TapeSnapshot snapshot;
+  TapeCursor cursor;
+  size_t limit;
+  std::vector<TapeTrade> matching;
+  std::string chunk;
+  bool first{true};
+  bool aborted{false};
+
+  TradeStream(TapeSnapshot taken, const TapeRange &range, size_t limit)
+      : snapshot(std::move(taken)), cursor(snapshot, range), limit(limit) {}
+
+  TradeStream(const TradeStream &) = delete;
+  auto operator=(const TradeStream &) -> TradeStream & = delete;
+
+  // Returns false while the socket has backpressure, the rest is written
+  // from onWritable
+  auto pump(uWS::HttpResponse<true> *res) -> bool {
+    if (aborted) {
+      return true;
+    }
+    while (limit > 0 && cursor.next(matching)) {
+      chunk.assign(first ? "[" : "");
+      for (const TapeTrade &trade :
+           std::span(matching).first(std::min(limit, matching.size()))) {
+        if (!first) {
+          chunk += ',';
+        }
+        first = false;
+        chunk += to_json(trade);
+        --limit;
+      }
+      // uWS keeps whatever didn't fit, false means wait for the drain
+      if (!res->write(chunk)) {
+        return false;
+      }
+    }
+    res->end(first ? "[]" : "]");
+    return true;
   }
+};
 
-  return portfolio_value;
+auto handle_trades_request(const std::vector<std::unique_ptr<Game>> &games) {
+  return [&games](uWS::HttpResponse<true> *res,
+                  uWS::HttpRequest *req) -> void {
+    Game *game = find_game(
+        games, req->getParameter(0).empty() ? "0" : req->getParameter(0));
+    std::optional<Asset> asset = parse_asset(req->getQuery("asset"));
+    TapeRange range;
+    size_t limit = std::numeric_limits<size_t>::max();
+    if (game == nullptr || !asset.has_value() ||
+        !query_number(req, "from_seq", range.from_seq) ||
+        !query_number(req, "to_seq", range.to_seq) ||
+        !query_number(req, "from_ms", range.from_ms) ||
+        !query_number(req, "to_ms", range.to_ms) ||
+        !query_number(req, "limit", limit)) {
+      res->end(R"({"error":"Expected a game, asset and numeric ranges."})");
+      return;
+    }
+    TradeTape *tape = game->exchanges[asset.value()].tape;
+    if (tape == nullptr) {
+      res->end(R"({"error":"The trade tape is disabled."})");
+      return;
+    }
+
+    auto stream =
+        std::make_shared<TradeStream>(tape->snapshot(), range, limit);
+    res->onAborted([stream]() { stream->aborted = true; });
+    res->writeHeader("Content-Type", "application/json");
+    if (!stream->pump(res)) {
+      res->onWritable([res, stream](uint64_t /*offset*/) -> bool {
+        bool drained = true;
+        res->cork([&]() { drained = stream->pump(res); });
+        return drained;
+      });
+    }
+  };
 }
 
-auto handle_leaderboard_request(
-    const std::vector<Exchange> &exchanges,
-    const std::unordered_map<uint32_t, std::string> &usernames) {
-  return [&exchanges, &usernames](uWS::HttpResponse<true> *res,
-                                  uWS::HttpRequest * /*req*/) -> void {
-    // auto get_portfolio_value = [&exchanges](uint32_t user_id) -> uint32_t {
-    //   if (!Exchange::user_cash.contains(user_id)) {
-    //     return 0;
-    //   }
-    //   uint32_t portfolio_value = Exchange::user_cash.at(user_id).amount_held;
-    //   std::optional<uint32_t> ruebens = {};
-    //   for (const auto& exchange : exchanges) {
-    //     if (exchange.user_assets.contains(user_id)) {
-    //       portfolio_value += exchange.user_assets.at(user_id).amount_held *
-    //                          value(exchange.asset);
-    //       if (ruebens.has_value()) {
-    //         ruebens = std::min(ruebens.value(),
-    //                            exchange.user_assets.at(user_id).amount_held);
-    //       } else {
-    //         ruebens = exchange.user_assets.at(user_id).amount_held;
-    //       }
-    //     }
-    //   }
-    //
-    //   if (ruebens.has_value()) {
-    //     portfolio_value += ruebens.value() * RUEBEN_VALUE;
-    //   }
-    //
-    //   return portfolio_value;
-    // };
+auto handle_audit_request(const std::vector<std::unique_ptr<Game>> &games) {
+  return [&games](uWS::HttpResponse<true> *res,
+                  uWS::HttpRequest * /*req*/) -> void {
+    std::unordered_map<uint32_t, AuditMetrics> metrics;
+    for (const auto &game : games) {
+      metrics[game->id] = game->audit_stats.metrics();
+    }
+    res->end(to_json(metrics));
+  };
+}
 
-    std::unordered_map<std::string, uint32_t> leaderboard;
-    leaderboard.reserve(Exchange::user_cash.size());
-    for (const auto [user_id, _] : Exchange::user_cash) {
-      if (!usernames.contains(user_id)) {
-        std::cout << "user_id: " << user_id << " has no username";
+// Which port serves each asset of each game, for clients and proxies
+auto handle_games_request(const std::vector<std::unique_ptr<Game>> &games,
+                          const Config &config) {
+  return [&games, &config](uWS::HttpResponse<true> *res,
+                           uWS::HttpRequest * /*req*/) -> void {
+    std::unordered_map<uint32_t, std::unordered_map<std::string, int>> ports;
+    for (const auto &game : games) {
+      for (uint8_t i = 0; i < NUM_ASSETS; ++i) {
+        auto asset = static_cast<Asset>(i);
+        ports[game->id][to_string_lower(asset)] =
+            config.venue_port(game->id, asset);
       }
-      leaderboard[usernames.at(user_id)] =
-          get_portfolio_value(exchanges, user_id);
     }
-    res->end(glz::write_json(leaderboard).value_or("Error encoding JSON."));
+    res->end(to_json(ports));
   };
 }
 
-auto run_api(const std::vector<Exchange> &exchanges,
-             const std::unordered_map<uint32_t, std::string> &usernames)
-    -> void {
-
-  uWS::SSLApp()
-      .get("/api/game/get_state", handle_state_request(exchanges))
-      .get("/api/game/get_leaderboard",
-           handle_leaderboard_request(exchanges, usernames))
-      .listen(3000,
-              [](us_listen_socket_t *listen_socket) {
-                if (listen_socket) {
-                  api_socket = listen_socket;
-                  // std::lock_guard lg(cout_mutex);
-                  // std::cout << "Listening on port " << 3000 << '\n';
-                }
-              })
-      .run();
+// Sends the encoding the client prefers, or nothing at all when its copy is
+// already current
+auto send_static(uWS::HttpResponse<true> *res, uWS::HttpRequest *req,
+                 const StaticFile &file) -> void {
+  if (req->getHeader("if-none-match").find(file.etag) !=
+      std::string_view::npos) {
+    res->writeStatus("304 Not Modified");
+    res->writeHeader("ETag", file.etag);
+    res->end();
+    return;
+  }
+  std::string_view accept = req->getHeader("accept-encoding");
+  std::string_view encoding;
+  std::string_view body = file.identity;
+  if (!file.brotli.empty() && accept.find("br") != std::string_view::npos) {
+    encoding = "br";
+    body = file.brotli;
+  } else if (!file.gzip.empty() &&
+             accept.find("gzip") != std::string_view::npos) {
+    encoding = "gzip";
+    body = file.gzip;
+  }
+  res->writeHeader("Content-Type", file.content_type);
+  res->writeHeader("ETag", file.etag);
+  res->writeHeader("Cache-Control", "no-cache");
+  res->writeHeader("Vary", "Accept-Encoding");
+  if (!encoding.empty()) {
+    res->writeHeader("Content-Encoding", encoding);
+  }
+  res->end(body);
 }
 
-auto main() -> int {
-  std::vector<Exchange> exchanges;
-  exchanges.reserve(NUM_ASSETS);
-  for (uint8_t i = 0; i < NUM_ASSETS; ++i) {
-    exchanges.emplace_back(static_cast<Asset>(i));
-  }
-
-  std::vector<std::thread *> threads(NUM_ASSETS);
-  std::unordered_map<uint32_t, std::string> usernames;
-  for (uint8_t i = 0; i < NUM_ASSETS; ++i) {
-    auto asset = static_cast<Asset>(i);
-    auto &exchange = exchanges[i];
-    threads[i] = new std::thread([asset, &exchange, &usernames]() {
-      run_asset_socket(asset, exchange, usernames);
-    });
+auto handle_static_request(const StaticFiles &files) {
+  return [&files](uWS::HttpResponse<true> *res,
+                  uWS::HttpRequest *req) -> void {
+    const StaticFile *file = files.find(req->getUrl());
+    if (file == nullptr) {
+      res->writeStatus("404 Not Found");
+      res->end();
+      return;
+    }
+    send_static(res, req, *file);
+  };
+}
+
+// Like the web app's own /game/ route, sessions it hasn't logged in are sent
+// to log in first
+auto handle_game_page_request(const StaticFiles &files, UserTable &users) {
+  return [&files, &users](uWS::HttpResponse<true> *res,
+                          uWS::HttpRequest *req) -> void {
+    if (users.find(cookie_value(req->getHeader("cookie"), SESSION_COOKIE)) ==
+        nullptr) {
+      res->writeStatus("302 Found");
+      res->writeHeader("Location", "/accounts/login/?next=/game/");
+      res->end();
+      return;
+    }
+    const StaticFile *page = files.find("/static/game.html");
+    if (page == nullptr) {
+      res->writeStatus("404 Not Found");
+      res->end();
+      return;
+    }
+    send_static(res, req, *page);
+  };
+}
+
+auto handle_user_info_request(UserTable &users) {
+  return [&users](uWS::HttpResponse<true> *res,
+                  uWS::HttpRequest *req) -> void {
+    const UserInfo *user =
+        users.find(cookie_value(req->getHeader("cookie"), SESSION_COOKIE));
+    if (user == nullptr) {
+      res->writeStatus("401 Unauthorized");
+      res->end(R"({"error":"Not logged in."})");
+      return;
+    }
+    res->writeHeader("Content-Type", "application/json");
+    res->end(to_json(*user));
+  };
+}
+
+// Hosts every game in one process. Each exchange is assigned to a shard
+// round robin and each shard is pinned to a core from the pool, so a single
+// game still gets a core per asset and many games spread across all cores.
+struct GameManager {
+  const Config &config;
+  std::vector<std::unique_ptr<Game>> games;
+  std::vector<std::unique_ptr<ShmFeedWriter>> shm_feeds;
+  std::vector<std::unique_ptr<TradeTape>> tapes;
+  std::deque<Shard> shards;
+  us_listen_socket_t *api_socket{nullptr};
+  uWS::Loop *api_loop{nullptr};
+  bool api_pinned{false};
+  std::thread api_thread;
+  std::thread audit_thread;
+  std::thread tape_thread;
+  // Wakes the background threads to stop
+  std::mutex audit_mutex;
+  std::condition_variable audit_wakeup;
+  bool stopping{false};
+  bool memory_locked{false};
+
+  explicit GameManager(const Config &config) : config(config) {
+    // The arenas are sized by the plan, without one there's nothing to map
+    if (config.huge_pages && config.prefault_orders == 0) {
+      std::cerr << "ZINGERS_HUGE_PAGES needs ZINGERS_PREFAULT_ORDERS to size "
+                   "each book's arena, not using huge pages\n";
+    }
+    for (uint32_t id = 0; id < config.games; ++id) {
+      games.push_back(std::make_unique<Game>(
+          id, config.huge_pages ? config.prefault_orders : 0));
+    }
+    for (auto &game : games) {
+      for (auto &exchange : game->exchanges) {
+        exchange.stats =
+            MarketStats(config.candle_interval_ms, config.candle_history);
+        if (config.trade_tape) {
+          exchange.tape =
+              tapes.emplace_back(std::make_unique<TradeTape>()).get();
+        }
+      }
+    }
+
+    if (config.shm_feed) {
+      for (auto &game : games) {
+        for (auto &exchange : game->exchanges) {
+          auto &shm_feed = shm_feeds.emplace_back(ShmFeedWriter::create(
+              game->id, exchange.asset, config.shm_feed_capacity));
+          if (shm_feed) {
+            exchange.shm_feed = shm_feed.get();
+            std::cout << "Shared memory feed at /dev/shm" << shm_feed->name
+                      << '\n';
+          }
+        }
+      }
+    }
+
+    std::vector<int> cores = config.cores;
+    if (cores.empty()) {
+      for (unsigned core = 0; core < std::thread::hardware_concurrency();
+           ++core) {
+        cores.push_back(static_cast<int>(core));
+      }
+    }
+    size_t num_venues = games.size() * NUM_ASSETS;
+    size_t num_shards = std::max<size_t>(
+        1, std::min(num_venues, std::max<size_t>(cores.size(), 1)));
+    for (size_t i = 0; i < num_shards; ++i) {
+      Shard &shard = shards.emplace_back();
+      shard.index = i;
+      if (i < cores.size()) {
+        shard.core = cores[i];
+      }
+    }
+    for (size_t i = 0; i < num_venues; ++i) {
+      shards[i % num_shards].assigned.emplace_back(
+          games[i / NUM_ASSETS].get(), static_cast<Asset>(i % NUM_ASSETS));
+    }
+
+    if (config.expected_users > 0 || config.prefault_orders > 0) {
+      for (auto &game : games) {
+        game->prefault(config.expected_users, config.prefault_orders);
+      }
+    }
+    // MCL_FUTURE also covers the shard stacks and loops created after this
+    if (config.lock_memory) {
+      memory_locked = mlockall(MCL_CURRENT | MCL_FUTURE) == 0;
+      if (!memory_locked) {
+        perror("mlockall");
+      }
+    }
+    report_footprint();
   }
 
-  std::thread api_thread(
-      [&exchanges, &usernames]() { run_api(exchanges, usernames); });
-  std::cout << "Type 'start' to end the game and display final leaderboard\n";
-  std::cout << "% ";
-  std::string cmd;
-  while (std::cin >> cmd && cmd != "start") {
+  // Printed before any socket listens, so it's what the game starts with
+  auto report_footprint() -> void {
+    constexpr size_t MIB = 1 << 20;
+    size_t arena_bytes = 0;
+    bool huge = true;
+    for (auto &game : games) {
+      for (auto &exchange : game->exchanges) {
+        if (exchange.arena) {
+          arena_bytes += exchange.arena->capacity;
+          huge = huge && exchange.arena->huge;
+        }
+      }
+    }
+    MemoryFootprint footprint = memory_footprint();
+    std::lock_guard lg(cout_mutex);
+    std::cout << "Planned for " << config.expected_users << " users and "
+              << config.prefault_orders << " resting orders per book, "
+              << footprint.resident / MIB << " MiB resident, "
+              << footprint.huge_pages / MIB << " MiB on huge pages\n";
+    if (arena_bytes > 0) {
+      std::cout << "Book arenas " << arena_bytes / MIB << " MiB"
+                << (huge ? "" : ", huge pages refused by the kernel") << '\n';
+    }
   }
-  accepting = true;
 
-  std::cout << "Type 'end' to end the game and display final leaderboard\n";
-  std::cout << "% ";
-  cmd = "";
-  while (std::cin >> cmd && cmd != "end") {
+  auto start() -> void {
+    std::latch ready(static_cast<std::ptrdiff_t>(shards.size()));
+    for (Shard &shard : shards) {
+      shard.thread =
+          std::thread([&shard, this, &ready]() { shard.run(config, ready); });
+    }
+    ready.wait();
+    std::latch api_ready(1);
+    api_thread = std::thread([this, &api_ready]() { run_api(api_ready); });
+    api_ready.wait();
+    if (config.audit_interval_ms > 0) {
+      audit_thread = std::thread([this]() { run_audits(); });
+    }
+    if (!tapes.empty()) {
+      tape_thread = std::thread([this]() { run_tape_sealer(); });
+    }
+    report_placement();
   }
-  accepting = false;
-  std::ranges::for_each(asset_sockets, [](us_listen_socket_t *listen_s) {
-    us_listen_socket_close(0, listen_s);
-  });
-  us_listen_socket_close(0, api_socket);
 
-  using namespace std::chrono_literals;
-  std::this_thread::sleep_for(1s);
+  // Encodes full trade tape blocks so appending under a book lock never does
+  auto run_tape_sealer() -> void {
+    std::unique_lock lock(audit_mutex);
+    while (!audit_wakeup.wait_for(lock, TradeTape::SEAL_INTERVAL,
+                                  [this]() { return stopping; })) {
+      lock.unlock();
+      for (auto &tape : tapes) {
+        tape->seal_pending();
+      }
+      lock.lock();
+    }
+  }
 
-  std::vector<std::pair<uint32_t, std::string>> leaderboard;
-  leaderboard.reserve(Exchange::user_cash.size());
-  for (const auto [user_id, _] : Exchange::user_cash) {
-    leaderboard.emplace_back(get_portfolio_value(exchanges, user_id),
-                             usernames[user_id]);
+  // Each book only pauses while the audit reads that one book, see
+  // Auditor.hpp
+  auto run_audits() -> void {
+    std::vector<AuditScratch> scratch(games.size());
+    std::unique_lock lock(audit_mutex);
+    while (!audit_wakeup.wait_for(
+        lock, std::chrono::milliseconds(config.audit_interval_ms),
+        [this]() { return stopping; })) {
+      lock.unlock();
+      for (size_t i = 0; i < games.size(); ++i) {
+        Game &game = *games[i];
+        AuditReport report = audit(game.exchanges, scratch[i]);
+        for (const std::string &violation : report.violations) {
+          std::cerr << "Game " << game.id << " audit: " << violation << '\n';
+        }
+        game.audit_stats.record(std::move(report));
+      }
+      lock.lock();
+    }
   }
-  std::ranges::sort(leaderboard, std::greater<>{});
-  for (const auto &[portfolio_value, username] : leaderboard) {
+
+  auto report_placement() -> void {
+    std::lock_guard lg(cout_mutex);
+    for (size_t i = 0; i < shards.size(); ++i) {
+      std::cout << "Shard " << i << " on "
+                << describe_core(shards[i].core, shards[i].pinned) << ":";
+      for (auto [game, asset] : shards[i].assigned) {
+        std::cout << " " << game->id << "/" << to_string_lower(asset);
+      }
+      std::cout << '\n';
+    }
+    std::optional<int> api_core;
+    if (config.api_core >= 0) {
+      api_core = config.api_core;
+    }
+    std::cout << "API on " << describe_core(api_core, api_pinned) << '\n';
+    std::cout << "Busy polling " << (config.busy_poll ? "on" : "off")
+              << ", memory " << (memory_locked ? "locked" : "not locked")
+              << ", " << config.prefault_orders
+              << " orders prefaulted per book\n";
+  }
+
+  auto run_api(std::latch &ready) -> void {
+    api_pinned = config.api_core >= 0 && pin_to_core(config.api_core);
+    name_trace_thread("api");
+    api_loop = uWS::Loop::get();
+    if (config.busy_poll) {
+      busy_poll(api_loop);
+    }
+    // Only touched from this thread
+    StaticFiles static_files;
+    if (!config.static_dir.empty()) {
+      static_files =
+          StaticFiles::load(config.static_dir, "/static", {"game.html"});
+      std::lock_guard lg(cout_mutex);
+      std::cout << "Serving " << static_files.files.size()
+                << " static files from " << config.static_dir << " ("
+                << static_files.bytes / 1024 << " KiB cached)\n";
+    }
+    UserTable users(config.sessions_file);
+    users.sessions.reserve(config.expected_users * config.games);
+
+    uWS::SSLApp app;
+    app.get("/static/*", handle_static_request(static_files))
+        .get("/game", handle_game_page_request(static_files, users))
+        .get("/game/", handle_game_page_request(static_files, users))
+        .get("/api/get_user_info", handle_user_info_request(users))
+        .get("/api/get_user_info/", handle_user_info_request(users))
+        .get("/api/games", handle_games_request(games, config))
+        .get("/api/trace", handle_trace_request())
+        .get("/api/audit", handle_audit_request(games))
+        .get("/api/game/get_state", handle_state_request(games))
+        .get("/api/game/get_leaderboard", handle_leaderboard_request(games))
+        .get("/api/game/get_market", handle_market_request(games))
+        .get("/api/game/get_trades", handle_trades_request(games))
+        .get("/api/game/:game/get_state", handle_state_request(games))
+        .get("/api/game/:game/get_leaderboard",
+             handle_leaderboard_request(games))
+        .get("/api/game/:game/get_market", handle_market_request(games))
+        .get("/api/game/:game/get_trades", handle_trades_request(games))
+        .listen(config.api_port,
+                [this](us_listen_socket_t *listen_socket) {
+                  if (listen_socket) {
+                    api_socket = listen_socket;
+                    // std::lock_guard lg(cout_mutex);
+                    // std::cout << "Listening on port " << 3000 << '\n';
+                  }
+                });
+    ready.count_down();
+    app.run();
+  }
+
+  auto stop() -> void {
+    for (Shard &shard : shards) {
+      shard.stop();
+    }
+    api_loop->defer([this]() { us_listen_socket_close(1, api_socket); });
+    {
+      std::scoped_lock lock(audit_mutex);
+      stopping = true;
+    }
+    audit_wakeup.notify_all();
+    for (Shard &shard : shards) {
+      shard.thread.join();
+    }
+    api_thread.join();
+    if (audit_thread.joinable()) {
+      audit_thread.join();
+    }
+    if (tape_thread.joinable()) {
+      tape_thread.join();
+    }
+  }
+};
+
+auto print_leaderboard(Game &game) -> void {
+  std::lock_guard lg(cout_mutex);
+  std::cout << "Game " << game.id << " final leaderboard\n";
+  for (const auto &[portfolio_value, username] : game.leaderboard()) {
     std::cout << username << ": " << portfolio_value << '\n';
   }
+}
+
+auto main() -> int {
+  const Config config = Config::from_env();
+  Tracer::instance().configure(config.trace_sample, config.trace_buffer_size);
+  GameManager manager(config);
+  manager.start();
+
+  std::cout << "Type 'start [game_id]' to start a game, or every game\n";
+  std::cout << "Type 'end [game_id]' to end a game and display its final "
+               "leaderboard, or every game\n";
+  std::vector<bool> ended(manager.games.size(), false);
+  size_t running = manager.games.size();
+  std::string line;
+  while (running > 0 && (std::cout << "% ") && std::getline(std::cin, line)) {
+    std::istringstream words(line);
+    std::string cmd;
+    std::string game_id;
+    words >> cmd >> game_id;
+    if (cmd != "start" && cmd != "end") {
+      continue;
+    }
+    std::vector<Game *> targets;
+    if (game_id.empty()) {
+      for (auto &game : manager.games) {
+        targets.push_back(game.get());
+      }
+    } else if (Game *game = find_game(manager.games, game_id)) {
+      targets.push_back(game);
+    } else {
+      std::cout << "No game " << game_id << '\n';
+      continue;
+    }
+    for (Game *game : targets) {
+      if (ended[game->id]) {
+        continue;
+      }
+      if (cmd == "start") {
+        game->accepting = true;
+      } else {
+        game->accepting = false;
+        ended[game->id] = true;
+        print_leaderboard(*game);
+        --running;
+      }
+    }
+  }
 
-  std::ranges::for_each(threads, [](std::thread *t) { t->join(); });
-  api_thread.join();
+  manager.stop();
 }
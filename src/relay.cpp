@@ -0,0 +1,394 @@
+// Re-fans one game's market data to spectators so the matching process only
+// has to serve traders. Subscribes to each of the game's books over the
+// network like any other client, starts from the exchange's snapshot and asks
+// for a fresh one whenever its seqs skip. ORDER, CANCEL, SNAPSHOT and TICKER
+// messages are forwarded exactly as the exchange wrote them, seq included, so
+// a client can't tell a relay from the exchange. Any number of relays can be
+// started with `ZINGERS_RELAY_PORT=<port> ./relay [game_id]`
+#include <algorithm>
+#include <charconv>
+#include <cstdint>
+#include <cstdlib>
+#include <deque>
+#include <iostream>
+#include <map>
+#include <optional>
+#include <string>
+#include <string_view>
+#include <utility>
+#include <vector>
+
+#include "App.h"
+#include <glaze/glaze.hpp>
+
+#include "Config.hpp"
+#include "Deflate.hpp"
+#include "Game.hpp"
+#include "Json.hpp"
+#include "Models.hpp"
+#include "WebSocketClient.hpp"
+#include "libusockets.h"
+
+constexpr std::string_view READ_ONLY_PAYLOAD =
+    R"({"type":3,"error":"Relays only serve market data."})";
+constexpr std::string_view SNAPSHOT_REQUEST_PAYLOAD = R"({"type":5})";
+
+// The parts of an exchange's messages a relay keeps its book with
+struct UpstreamMessage {
+  std::optional<MessageType> type;
+  std::optional<uint64_t> seq;
+  std::optional<std::vector<Trade>> trades;
+  std::optional<Order> unmatched_order;
+  std::optional<uint32_t> order_id;
+  std::optional<std::vector<Order>> orders;
+};
+
+// Times, tickers and the like are only passed along
+constexpr glz::opts UPSTREAM_OPTS{.error_on_unknown_keys = false};
+
+// One book mirrored from its exchange. Resting orders are kept so late joiners
+// get a snapshot from the relay instead of the matching process.
+struct RelayBook {
+  Asset asset;
+  uWS::SSLApp *app;
+  WebSocketClient upstream;
+  std::string topic;
+  std::string deflate_topic;
+  size_t compress_threshold;
+  // Ordered by id, which is also time priority within a level
+  std::map<uint32_t, Order> resting;
+  // Exchange seq of the last event applied
+  uint64_t seq{0};
+  // From the snapshot on, anything before it is either in it or lost
+  bool synced{false};
+  bool connected{false};
+  // Forwarded payloads, the one with seq s at s % size() next to s itself
+  // since a resync leaves holes
+  std::vector<std::pair<uint64_t, std::string>> replay;
+
+  RelayBook(Asset asset, uWS::SSLApp *app, const Config &config,
+            uint32_t game_id, int port)
+      : asset(asset),
+        app(app),
+        upstream(config.relay_upstream_host, port,
+                 "/game/" + std::to_string(game_id) + "/asset/" +
+                     to_string_lower(asset)),
+        topic(to_string_lower(asset)),
+        deflate_topic(topic + "/deflate"),
+        compress_threshold(config.compress_threshold),
+        replay(config.replay_buffer_size) {
+    upstream.on_open = [this]() {
+      connected = true;
+      std::cout << "Following " << upstream.host << ":" << upstream.port
+                << upstream.path << '\n';
+      resync();
+    };
+    upstream.on_message = [this](std::string_view payload) {
+      on_upstream(payload);
+    };
+    upstream.on_close = [this]() {
+      if (connected) {
+        std::cerr << "Lost " << upstream.path << ", reconnecting\n";
+      }
+      connected = false;
+      synced = false;
+    };
+  }
+
+  RelayBook(const RelayBook &) = delete;
+  auto operator=(const RelayBook &) -> RelayBook & = delete;
+
+  auto resync() -> void {
+    synced = false;
+    upstream.send(SNAPSHOT_REQUEST_PAYLOAD);
+  }
+
+  auto publish(std::string_view payload) -> void {
+    publish_deflated(app, topic, deflate_topic, compress_threshold, payload,
+                     uWS::OpCode::TEXT);
+  }
+
+  auto on_upstream(std::string_view payload) -> void {
+    UpstreamMessage message{};
+    if (glz::read<UPSTREAM_OPTS>(message, payload) ||
+        !message.type.has_value()) {
+      return;
+    }
+    switch (message.type.value()) {
+    case SNAPSHOT:
+      apply_snapshot(message);
+      // Spectators start over from it just like the relay
+      publish(payload);
+      return;
+    case TICKER:
+      publish(payload);
+      return;
+    case ORDER:
+    case CANCEL:
+      break;
+    case REGISTER:
+    case ERROR:
+    case BASKET:
+    case RESUME:
+    case PING:
+    case POSITION:
+      return;
+    }
+    if (!synced || !message.seq.has_value() || message.seq.value() <= seq) {
+      return;
+    }
+    if (message.seq.value() != seq + 1) {
+      std::cerr << to_string(asset) << " relay missed seqs " << seq + 1
+                << " to " << message.seq.value() - 1 << ", resyncing\n";
+      resync();
+      return;
+    }
+    apply(message);
+    seq = message.seq.value();
+    publish(payload);
+    if (!replay.empty()) {
+      auto &[slot_seq, slot_payload] = replay[seq % replay.size()];
+      slot_seq = seq;
+      slot_payload.assign(payload);
+    }
+  }
+
+  auto apply_snapshot(const UpstreamMessage &message) -> void {
+    resting.clear();
+    if (message.orders.has_value()) {
+      for (const Order &order : message.orders.value()) {
+        resting.insert_or_assign(order.order_id, order);
+      }
+    }
+    seq = message.seq.value_or(0);
+    synced = true;
+  }
+
+  auto apply(const UpstreamMessage &message) -> void {
+    if (message.type == CANCEL) {
+      if (message.order_id.has_value()) {
+        resting.erase(message.order_id.value());
+      }
+      return;
+    }
+    // Each fill names the resting order it took volume from
+    if (message.trades.has_value()) {
+      for (const Trade &trade : message.trades.value()) {
+        auto maker = resting.find(trade.order_id);
+        if (maker == resting.end()) {
+          continue;
+        }
+        maker->second.volume -= std::min(maker->second.volume, trade.volume);
+        if (maker->second.volume == 0) {
+          resting.erase(maker);
+        }
+      }
+    }
+    if (message.unmatched_order.has_value()) {
+      resting.insert_or_assign(message.unmatched_order->order_id,
+                               message.unmatched_order.value());
+    }
+  }
+
+  // In the exchange's own order: bids best first, then asks best first, each
+  // level in time priority
+  [[nodiscard]] auto snapshot() const -> std::vector<Order> {
+    std::vector<Order> orders;
+    orders.reserve(resting.size());
+    for (const auto &[_, order] : resting) {
+      orders.push_back(order);
+    }
+    std::ranges::stable_sort(orders, [](const Order &a, const Order &b) {
+      if (a.side != b.side) {
+        return a.side == BUY;
+      }
+      return a.side == BUY ? a.price > b.price : a.price < b.price;
+    });
+    return orders;
+  }
+
+  // Whether everything after since is still in the ring
+  [[nodiscard]] auto can_replay(uint64_t since) const -> bool {
+    if (replay.empty() || since > seq || seq - since > replay.size()) {
+      return false;
+    }
+    for (uint64_t s = since + 1; s <= seq; ++s) {
+      if (replay[s % replay.size()].first != s) {
+        return false;
+      }
+    }
+    return true;
+  }
+};
+
+// The exchanges' ports, either listed or where the exchange puts each book
+auto upstream_port(const Config &config, uint32_t game_id, Asset asset)
+    -> int {
+  if (!config.relay_upstream_ports.empty()) {
+    return config.relay_upstream_ports[asset];
+  }
+  return config.venue_port(game_id, asset);
+}
+
+struct Relay {
+  us_socket_context_t *context;
+  std::deque<RelayBook> books;
+
+  auto reconnect() -> void {
+    for (RelayBook &book : books) {
+      book.upstream.connect(context);
+    }
+  }
+};
+
+auto send_snapshot(const RelayBook &book,
+                   uWS::WebSocket<true, true, SocketData> *ws) -> void {
+  OutgoingMessage outgoing{};
+  outgoing.type = SNAPSHOT;
+  outgoing.orders = book.snapshot();
+  outgoing.seq = book.seq;
+  send_deflated(ws, ws->getUserData()->deflate, book.compress_threshold,
+                to_json(outgoing), uWS::OpCode::TEXT);
+}
+
+auto main(int argc, char **argv) -> int {
+  const Config config = Config::from_env();
+  uint32_t game_id = 0;
+  if (argc > 1) {
+    std::string_view arg(argv[1]);
+    auto [ptr, ec] =
+        std::from_chars(arg.data(), arg.data() + arg.size(), game_id);
+    if (ec != std::errc{} || ptr != arg.data() + arg.size()) {
+      std::cerr << "Usage: relay [game_id]\n";
+      return 1;
+    }
+  }
+  if (!config.relay_upstream_ports.empty() &&
+      config.relay_upstream_ports.size() != NUM_ASSETS) {
+    std::cerr << "ZINGERS_RELAY_UPSTREAM_PORTS needs a port per asset\n";
+    return 1;
+  }
+
+  uWS::SSLApp app;
+  auto *loop = reinterpret_cast<us_loop_t *>(uWS::Loop::get());
+  Relay relay{.context = WebSocketClient::create_context(loop), .books = {}};
+  for (uint8_t i = 0; i < NUM_ASSETS; ++i) {
+    auto asset = static_cast<Asset>(i);
+    relay.books.emplace_back(asset, &app, config, game_id,
+                             upstream_port(config, game_id, asset));
+  }
+
+  for (RelayBook &book : relay.books) {
+    // Until the relay has synced, the snapshot it's waiting on gets published
+    // to everyone subscribed
+    auto on_open = [&book](uWS::WebSocket<true, true, SocketData> *ws) {
+      ws->subscribe(book.topic);
+      if (book.synced) {
+        send_snapshot(book, ws);
+      }
+    };
+
+    auto on_open_deflate =
+        [&book](uWS::WebSocket<true, true, SocketData> *ws) {
+          ws->getUserData()->deflate = true;
+          ws->subscribe(book.deflate_topic);
+          if (book.synced) {
+            send_snapshot(book, ws);
+          }
+        };
+
+    auto on_message = [&book](uWS::WebSocket<true, true, SocketData> *ws,
+                              std::string_view message,
+                              uWS::OpCode /*op_code*/) {
+      IncomingMessage incoming{};
+      if (glz::read_json(incoming, message) || !incoming.type.has_value()) {
+        return;
+      }
+      switch (incoming.type.value()) {
+      case RESUME:
+        if (!book.synced) {
+          break;
+        }
+        if (!incoming.seq.has_value() ||
+            !book.can_replay(incoming.seq.value())) {
+          send_snapshot(book, ws);
+          break;
+        }
+        for (uint64_t s = incoming.seq.value() + 1; s <= book.seq; ++s) {
+          send_deflated(ws, ws->getUserData()->deflate,
+                        book.compress_threshold,
+                        book.replay[s % book.replay.size()].second,
+                        uWS::OpCode::TEXT);
+        }
+        break;
+      case SNAPSHOT:
+        if (book.synced) {
+          send_snapshot(book, ws);
+        }
+        break;
+      case PING: {
+        OutgoingMessage outgoing{};
+        outgoing.type = PING;
+        outgoing.client_time = incoming.client_time;
+        outgoing.server_ns = monotonic_ns();
+        ws->send(to_json(outgoing), uWS::OpCode::TEXT);
+        break;
+      }
+      case ORDER:
+      case CANCEL:
+      case BASKET:
+        ws->send(READ_ONLY_PAYLOAD, uWS::OpCode::TEXT);
+        break;
+      case REGISTER:
+      case ERROR:
+      case TICKER:
+      case POSITION:
+        break;
+      }
+    };
+
+    for (const std::string &path :
+         {"/asset/" + book.topic,
+          "/game/" + std::to_string(game_id) + "/asset/" + book.topic}) {
+      app.ws<SocketData>(path,
+                         {
+                             .idleTimeout = 10,
+                             .maxBackpressure = config.backpressure_hard_limit,
+                             .closeOnBackpressureLimit = true,
+                             .open = on_open,
+                             .message = on_message,
+                         });
+      app.ws<SocketData>(path + "/deflate",
+                         {
+                             .idleTimeout = 10,
+                             .maxBackpressure = config.backpressure_hard_limit,
+                             .closeOnBackpressureLimit = true,
+                             .open = on_open_deflate,
+                             .message = on_message,
+                         });
+    }
+  }
+
+  relay.reconnect();
+  us_timer_t *reconnect_timer = us_create_timer(loop, 0, sizeof(Relay *));
+  *static_cast<Relay **>(us_timer_ext(reconnect_timer)) = &relay;
+  us_timer_set(
+      reconnect_timer,
+      [](us_timer_t *timer) {
+        (*static_cast<Relay **>(us_timer_ext(timer)))->reconnect();
+      },
+      static_cast<int>(config.relay_reconnect_ms),
+      static_cast<int>(config.relay_reconnect_ms));
+
+  app.listen(config.relay_port, [&config, game_id](auto *listen_s) {
+    if (!listen_s) {
+      std::cerr << "Failed to listen on port " << config.relay_port << '\n';
+      std::exit(1);
+    }
+    std::cout << "Relaying game " << game_id << " on port "
+              << config.relay_port << '\n';
+  });
+  app.run();
+
+  us_timer_close(reconnect_timer);
+}